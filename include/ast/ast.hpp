@@ -2,36 +2,32 @@
 #define AST_H_
 
 #include "codegen.hpp"
+#include "lexer.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <utility>
+#include <variant>
 #include <vector>
 
 namespace ast {
 
-class Expr {
-public:
-  virtual std::string tree_format(uint32_t indent_level) = 0;
-  virtual ~Expr() = default;
-  virtual llvm::Value *codegen(codegen::LLVMCodegenCtx *llctx) = 0;
-};
+class Expr;
+using ExprPtr = std::unique_ptr<Expr>;
 
-class NumberExpr : public Expr {
+class NumberExpr {
+public:
   double val;
 
-public:
   NumberExpr(double val) : val(val) {}
-  llvm::Value *codegen(codegen::LLVMCodegenCtx *llctx) override;
-  std::string tree_format(uint32_t indent_level) override;
 };
 
-class VariableExpr : public Expr {
+class VariableExpr {
+public:
   std::string name;
 
-public:
   VariableExpr(const std::string &name) : name(name) {}
-  llvm::Value *codegen(codegen::LLVMCodegenCtx *llctx) override;
-  std::string tree_format(uint32_t indent_level) override;
 };
 
 enum class OperatorKind {
@@ -42,83 +38,166 @@ enum class OperatorKind {
   Asterisk,
 };
 
-class BinaryExpr : public Expr {
+class BinaryExpr {
+public:
   OperatorKind op;
-  std::unique_ptr<Expr> left;
-  std::unique_ptr<Expr> right;
+  ExprPtr left;
+  ExprPtr right;
 
-public:
-  BinaryExpr(OperatorKind op, std::unique_ptr<Expr> left,
-             std::unique_ptr<Expr> right)
+  BinaryExpr(OperatorKind op, ExprPtr left, ExprPtr right)
       : op(op), left(std::move(left)), right(std::move(right)) {}
-
-  llvm::Value *codegen(codegen::LLVMCodegenCtx *llctx) override;
-  std::string tree_format(uint32_t indent_level) override;
 };
 
-class CallExpr : public Expr {
+class CallExpr {
+public:
   std::string callee;
-  std::vector<std::unique_ptr<Expr>> args;
+  std::vector<ExprPtr> args;
 
-public:
-  CallExpr(const std::string &callee, std::vector<std::unique_ptr<Expr>> args)
+  CallExpr(const std::string &callee, std::vector<ExprPtr> args)
       : callee(callee), args(std::move(args)) {}
-
-  llvm::Value *codegen(codegen::LLVMCodegenCtx *llctx) override;
-  std::string tree_format(uint32_t indent_level) override;
 };
 
-class IfExpr : public Expr {
-  std::unique_ptr<ast::Expr> Cond;
-  std::unique_ptr<ast::Expr> Then;
-  std::unique_ptr<ast::Expr> Else;
-
+class IfExpr {
 public:
-  IfExpr(std::unique_ptr<Expr> Cond, std::unique_ptr<Expr> Then,
-         std::unique_ptr<Expr> Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+  ExprPtr Cond;
+  ExprPtr Then;
+  ExprPtr Else;
 
-  llvm::Value *codegen(codegen::LLVMCodegenCtx *llctx) override;
-  std::string tree_format(uint32_t indent_level) override;
+  IfExpr(ExprPtr Cond, ExprPtr Then, ExprPtr Else)
+      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
 };
 
-class ForExpr : public Expr {
-  std::string VarName;
-  std::unique_ptr<Expr> Start;
-  std::unique_ptr<Expr> End;
-  std::unique_ptr<Expr> Step;
-  std::unique_ptr<Expr> Body;
+// Annotations written before a loop's `in`; a count of 0 leaves the choice
+// to the optimisers
+struct LoopHints {
+  unsigned unroll = 0;    // @unroll(n)
+  bool noUnroll = false;  // @nounroll
+  unsigned vectorize = 0; // @vectorize(width)
+};
 
+class ForExpr {
 public:
-  ForExpr(const std::string &VarName, std::unique_ptr<Expr> Start,
-          std::unique_ptr<Expr> End, std::unique_ptr<Expr> Step,
-          std::unique_ptr<Expr> Body)
+  std::string VarName;
+  ExprPtr Start;
+  ExprPtr End;
+  ExprPtr Step; // optional
+  ExprPtr Body;
+  LoopHints hints;
+
+  ForExpr(const std::string &VarName, ExprPtr Start, ExprPtr End,
+          ExprPtr Step, ExprPtr Body)
       : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
         Step(std::move(Step)), Body(std::move(Body)) {}
+};
+
+// Stands for a subtree shared by every structurally equal occurrence of a
+// pure expression (see ast::Interner). Code for it is generated once per
+// scope and reused.
+class SharedExpr {
+public:
+  std::shared_ptr<Expr> expr;
 
-  llvm::Value *codegen(codegen::LLVMCodegenCtx *llctx) override;
-  std::string tree_format(uint32_t indent_level) override;
+  SharedExpr(std::shared_ptr<Expr> expr) : expr(std::move(expr)) {}
 };
 
+// The closed set of expression kinds. Passes are written as visitors over
+// this variant (see ast/visitor.hpp) instead of virtual methods on the nodes,
+// so adding a pass never touches this file and dispatch is a single switch.
+using ExprNode = std::variant<NumberExpr, VariableExpr, BinaryExpr, CallExpr,
+                              IfExpr, ForExpr, SharedExpr>;
+
+class Expr {
+public:
+  ExprNode node;
+  // Where the expression starts; operators are located at the operator
+  SourceLocation loc;
+
+  template <typename T, typename... Args>
+  explicit Expr(std::in_place_type_t<T> kind, Args &&...args)
+      : node(kind, std::forward<Args>(args)...) {}
+
+  // Tears the subtree down iteratively; the implicit destructor would recurse
+  // once per level of nesting
+  ~Expr();
+  Expr(Expr &&) = default;
+  Expr &operator=(Expr &&) = default;
+
+  template <typename T> bool is() const {
+    return std::holds_alternative<T>(node);
+  }
+  template <typename T> T *getIf() { return std::get_if<T>(&node); }
+  template <typename T> const T *getIf() const { return std::get_if<T>(&node); }
+};
+
+template <typename T, typename... Args> ExprPtr make(Args &&...args) {
+  return std::make_unique<Expr>(std::in_place_type<T>,
+                                std::forward<Args>(args)...);
+}
+
+// Lane counts a value can have: 1 for a double, otherwise a vector of that
+// many doubles (vec2, vec4, vec8) lowered to an LLVM vector type
+inline bool validLanes(unsigned lanes) {
+  return lanes == 1 || lanes == 2 || lanes == 4 || lanes == 8;
+}
+// "double" or "vec<lanes>", as written in annotations
+std::string typeName(unsigned lanes);
+
+// Annotations written after a prototype
+struct FunctionHints {
+  bool alwaysInline = false; // @inline
+  bool noInline = false;     // @noinline
+  bool hot = false;          // @hot
+  bool cold = false;         // @cold
+  // @pure: no side effects and always returns, so unused calls may go
+  bool pure = false;
+};
+
+// What ast::inferEffects proved about a function
+struct FunctionEffects {
+  // Neither touches memory nor unwinds
+  bool pure = false;
+  // Returns from every call
+  bool willReturn = false;
+};
+
+// The hints as written in the source, e.g. {"@inline", "@hot"}
+std::vector<std::string> annotations(const FunctionHints &hints);
+std::vector<std::string> annotations(const LoopHints &hints);
+
 class FunctionPrototype {
 public:
   std::string name;
   std::vector<std::string> args;
-
-  FunctionPrototype(const std::string &name, std::vector<std::string> args)
-      : name(name), args(std::move(args)) {}
+  // Lanes of each argument and of the result
+  std::vector<unsigned> argLanes;
+  unsigned lanes = 1;
+  FunctionHints hints;
+  FunctionEffects effects;
+  SourceLocation loc;
+
+  FunctionPrototype(const std::string &name, std::vector<std::string> args,
+                    std::vector<unsigned> argLanes = {}, unsigned lanes = 1)
+      : name(name), args(std::move(args)), argLanes(std::move(argLanes)),
+        lanes(lanes) {
+    this->argLanes.resize(this->args.size(), 1);
+  }
 
   const std::string &getName() const { return this->name; }
-  llvm::Function *codegen(codegen::LLVMCodegenCtx *llctx);
+  // Whether any argument or the result is a vector
+  bool usesVectors() const {
+    return lanes != 1 || std::ranges::any_of(argLanes, [](unsigned n) {
+             return n != 1;
+           });
+  }
+  llvm::Function *codegen(codegen::LLVMCodegenCtx *llctx) const;
 };
 
 class FunctionDefinition {
 public:
   std::unique_ptr<FunctionPrototype> proto;
-  std::unique_ptr<Expr> body;
+  ExprPtr body;
 
-  FunctionDefinition(std::unique_ptr<FunctionPrototype> proto,
-                     std::unique_ptr<Expr> body)
+  FunctionDefinition(std::unique_ptr<FunctionPrototype> proto, ExprPtr body)
       : proto(std::move(proto)), body(std::move(body)) {}
 
   llvm::Function *codegen(codegen::LLVMCodegenCtx *llctx);
@@ -128,11 +207,15 @@ class CompilationUnit {
 public:
   std::string name;
   std::vector<std::unique_ptr<ast::FunctionDefinition>> functions;
+  // Functions defined outside the program
+  std::vector<std::unique_ptr<ast::FunctionPrototype>> externs;
 
   CompilationUnit(
       std::string name,
-      std::vector<std::unique_ptr<ast::FunctionDefinition>> functions)
-      : name(name), functions(std::move(functions)) {}
+      std::vector<std::unique_ptr<ast::FunctionDefinition>> functions,
+      std::vector<std::unique_ptr<ast::FunctionPrototype>> externs = {})
+      : name(name), functions(std::move(functions)),
+        externs(std::move(externs)) {}
 
   llvm::Module *codegen(codegen::LLVMCodegenCtx *llctx);
 };
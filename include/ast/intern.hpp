@@ -0,0 +1,43 @@
+#ifndef AST_INTERN_H_
+#define AST_INTERN_H_
+
+#include "ast/ast.hpp"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <variant>
+
+namespace ast {
+
+// Hash-consing table for the parser. Pure subtrees (arithmetic on numbers
+// and variables) are looked up by structure as they are built, and every
+// occurrence after the first becomes a reference to the first one, turning
+// repeated subexpressions into a DAG.
+class Interner {
+public:
+  // A SharedExpr for `expr`, or `expr` itself if it cannot be shared.
+  // Children must have been interned already.
+  ExprPtr intern(ExprPtr expr);
+
+  // Distinct shared subtrees / occurrences replaced by a reference
+  size_t distinct() const { return table.size(); }
+  size_t reused() const { return hits; }
+
+private:
+  // A leaf by value (a number by its bits, so 0.0 and -0.0 differ) or an
+  // already shared subtree by identity
+  using Operand = std::variant<uint64_t, std::string, const Expr *>;
+  using Key = std::tuple<OperatorKind, Operand, Operand>;
+
+  std::map<Key, std::shared_ptr<Expr>> table;
+  size_t hits = 0;
+
+  static std::optional<Operand> operand(const Expr &expr);
+};
+
+} // namespace ast
+
+#endif // AST_INTERN_H_
@@ -2,14 +2,66 @@
 #define PARSER_H_
 
 #include "ast.hpp"
+#include "ast/intern.hpp"
 #include "lexer.hpp"
 #include <deque>
+#include <functional>
+#include <optional>
+#include <variant>
 
 namespace parser {
 
+// Tokens in the order the parser consumes them, either all known up front or
+// pulled from a source in chunks as parsing advances, so only a window of the
+// input has to be held at a time
+class TokenStream {
+public:
+  // Appends the next tokens to `out`; returns false once there are no more
+  using Source = std::function<bool(std::deque<Token> &out)>;
+
+  explicit TokenStream(std::deque<Token> tokens)
+      : buffered(std::move(tokens)) {}
+  explicit TokenStream(Source source) : source(std::move(source)) {}
+
+  // The current token, EndOfInput once the stream is exhausted
+  Token &front() { return peek(0); }
+  // The token `n` places after the current one
+  Token &peek(size_t n);
+  void pop_front();
+  bool empty() { return !fill(1); }
+
+  // When set, expressions are hash-consed through it as they are parsed
+  ast::Interner *interner = nullptr;
+  // How many expressions are being parsed inside one another
+  unsigned depth = 0;
+
+private:
+  std::deque<Token> buffered;
+  Source source;
+  Token endOfInput{TokenKind::EndOfInput};
+
+  // Make sure at least `n` tokens are buffered, if the input has that many
+  bool fill(size_t n);
+};
+
+// With `hashCons`, repeated pure subexpressions are parsed into shared nodes
 std::unique_ptr<ast::CompilationUnit> parse(std::deque<Token> &tokens,
-                                            std::string filename);
+                                            std::string filename,
+                                            bool hashCons = false);
+
+// Lex and parse a whole buffer; nullptr (after logging) on error
+std::unique_ptr<ast::CompilationUnit> parseBuffer(const llvm::MemoryBuffer *buf,
+                                                  std::string filename,
+                                                  bool hashCons = false);
+
+// A function definition (top-level expressions included) or an extern
+using TopLevel = std::variant<std::unique_ptr<ast::FunctionDefinition>,
+                              std::unique_ptr<ast::FunctionPrototype>>;
+
+// Parse the next definition, extern or top-level expression; std::nullopt on
+// error
+std::optional<TopLevel> parseTopLevel(TokenStream &tokens);
 
-}
+} // namespace parser
 
 #endif // PARSER_H_
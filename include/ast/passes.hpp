@@ -0,0 +1,37 @@
+#ifndef AST_PASSES_H_
+#define AST_PASSES_H_
+
+#include "ast/ast.hpp"
+#include <string>
+#include <vector>
+
+namespace ast {
+
+// Fold operators on literal operands and conditionals with a literal
+// condition, in place.
+void foldConstants(CompilationUnit &cu);
+void foldConstants(FunctionDefinition &fn);
+
+// Clone functions for the literal arguments they are called with at least
+// `minCalls` times: each clone takes only the other arguments, has the
+// literals folded through its body and replaces the generic function at
+// those calls. Calls with the same callee and literals share a clone. Large
+// bodies are not cloned, and clones add at most about half the unit's size.
+void specialiseCalls(CompilationUnit &cu, unsigned minCalls);
+
+// Drop the definitions that cannot be called, directly or not, from a
+// top-level expression or from the functions named in `roots` (those called
+// from outside the program). Calls are resolved by name across all `units`.
+// Returns the number of definitions dropped.
+size_t pruneUnreachable(const std::vector<CompilationUnit *> &units,
+                        const std::vector<std::string> &roots);
+
+// Prove which functions are pure (no memory access, no unwinding) and which
+// always return, and record it in their prototypes' effects. Calls to
+// functions of other modules are assumed to do anything; a function returns
+// if its loops have literal bounds and it cannot recurse.
+void inferEffects(const std::vector<CompilationUnit *> &units);
+
+} // namespace ast
+
+#endif // AST_PASSES_H_
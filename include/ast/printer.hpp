@@ -2,8 +2,63 @@
 #define AST_PRINTER_H_
 
 #include "ast/ast.hpp"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <format>
 
-#define INDENT "  "
+namespace ast {
+
+enum class DumpFormat {
+  // Indented, human readable tree
+  Tree,
+  // One S-expression per function per line
+  SExpr,
+  // One JSON object per function per line. Numbers that JSON cannot
+  // represent are written as the strings "inf", "-inf" and "nan"
+  Json,
+};
+
+// All printers stream straight into `os` in a single pass over the tree;
+// nothing is built up in intermediate strings.
+void print(llvm::raw_ostream &os, const Expr &expr,
+           DumpFormat format = DumpFormat::Tree, unsigned indent_level = 0);
+void print(llvm::raw_ostream &os, const FunctionPrototype &proto,
+           DumpFormat format = DumpFormat::Tree, unsigned indent_level = 0);
+void print(llvm::raw_ostream &os, const FunctionDefinition &fn,
+           DumpFormat format = DumpFormat::Tree);
+void print(llvm::raw_ostream &os, const CompilationUnit &cu,
+           DumpFormat format = DumpFormat::Tree);
+
+// C header declaring the unit's named functions with C linkage, for a native
+// library built from it; the include guard is derived from `headerPath`
+void printCHeader(llvm::raw_ostream &os, const CompilationUnit &cu,
+                  llvm::StringRef headerPath);
+
+const char *operatorSymbol(OperatorKind op);
+
+// raw_ostream writing into a std::format output iterator, which lets the
+// std::formatter specialisations below reuse the streaming printers
+class FormatOStream : public llvm::raw_ostream {
+  std::format_context::iterator out;
+  uint64_t written = 0;
+
+  void write_impl(const char *ptr, size_t size) override {
+    out = std::copy(ptr, ptr + size, out);
+    written += size;
+  }
+  uint64_t current_pos() const override { return written; }
+
+public:
+  FormatOStream(std::format_context::iterator out) : out(out) {}
+  ~FormatOStream() override { flush(); }
+
+  std::format_context::iterator iterator() {
+    flush();
+    return out;
+  }
+};
+
+} // namespace ast
 
 template <> struct std::formatter<ast::FunctionPrototype> {
   int indent_level = 0;
@@ -20,22 +75,9 @@ template <> struct std::formatter<ast::FunctionPrototype> {
 
   auto format(const ast::FunctionPrototype &fn,
               std::format_context &ctx) const {
-    std::string indent = "";
-
-    for (int i = 0; i < this->indent_level; ++i)
-      indent += INDENT;
-
-    std::string name = fn.getName();
-    if (name.empty())
-      name = "[Anonymous]";
-    std::format_to(ctx.out(), "{}Name: {}", indent, name);
-
-    if (!fn.args.empty()) {
-      std::format_to(ctx.out(), "\n{}Args: ", indent);
-      for (auto &arg : fn.args)
-        std::format_to(ctx.out(), "{} ", arg);
-    }
-    return std::format_to(ctx.out(), "");
+    ast::FormatOStream os(ctx.out());
+    ast::print(os, fn, ast::DumpFormat::Tree, this->indent_level);
+    return os.iterator();
   }
 };
 
@@ -43,43 +85,26 @@ template <> struct std::formatter<ast::FunctionDefinition> {
   constexpr auto parse(std::format_parse_context &ctx) { return ctx.begin(); }
   auto format(const ast::FunctionDefinition &fn,
               std::format_context &ctx) const {
-    std::format_to(ctx.out(), "FunctionDefinition\n");
-    std::string proto = std::format("{}Proto:\n{:2}", INDENT, *fn.proto);
-    std::string body = fn.body->tree_format(2);
-    return std::format_to(ctx.out(), "{}\n{}Body:\n{}", proto, INDENT, body);
+    ast::FormatOStream os(ctx.out());
+    ast::print(os, fn);
+    return os.iterator();
   }
 };
 
 template <> struct std::formatter<ast::CompilationUnit> {
   constexpr auto parse(std::format_parse_context &ctx) { return ctx.begin(); }
   auto format(const ast::CompilationUnit &cu, std::format_context &ctx) const {
-    std::format_to(ctx.out(), "CompilationUnit\n\n");
-    for (auto &fn : cu.functions)
-      std::format_to(ctx.out(), "{}\n", *fn);
-    return std::format_to(ctx.out(), "");
+    ast::FormatOStream os(ctx.out());
+    ast::print(os, cu);
+    return os.iterator();
   }
 };
 
-#define OP_KIND_FORMAT_CASE(name, symbol)                                      \
-  case ast::OperatorKind::name:                                                \
-    result = symbol;                                                           \
-    break;
-
 template <> struct std::formatter<ast::OperatorKind> {
   constexpr auto parse(std::format_parse_context &ctx) { return ctx.begin(); }
   auto format(const ast::OperatorKind &op, std::format_context &ctx) const {
-    std::string result;
-    switch (op) {
-      OP_KIND_FORMAT_CASE(Plus, "+")
-      OP_KIND_FORMAT_CASE(Minus, "-")
-      OP_KIND_FORMAT_CASE(Asterisk, "*")
-      OP_KIND_FORMAT_CASE(LessThan, "<")
-      OP_KIND_FORMAT_CASE(GreaterThan, "<")
-    }
-    return std::format_to(ctx.out(), "{}", result);
+    return std::format_to(ctx.out(), "{}", ast::operatorSymbol(op));
   }
 };
 
-#undef OP_KIND_FORMAT_CASE
-
 #endif // AST_PRINTER_H_
@@ -0,0 +1,42 @@
+#ifndef AST_TYPES_H_
+#define AST_TYPES_H_
+
+#include "ast/ast.hpp"
+#include <unordered_map>
+
+namespace ast {
+
+// What a value is proven to be. Kaleidoscope only has doubles; Int and Bool
+// values are doubles known to hold an exactly representable integer, or 0 or
+// 1, and are lowered to i64 and i1 without changing any result.
+enum class ValueType {
+  Bool,
+  Int,
+  Double,
+};
+
+// Result of type inference over one function. Anything not recorded is a
+// Double, so an empty TypeInfo lowers everything to doubles.
+struct TypeInfo {
+  std::unordered_map<const Expr *, ValueType> values;
+  // Loop variables
+  std::unordered_map<const ForExpr *, ValueType> counters;
+
+  ValueType of(const Expr &expr) const {
+    auto entry = values.find(&expr);
+    return entry == values.end() ? ValueType::Double : entry->second;
+  }
+  ValueType counter(const ForExpr &loop) const {
+    auto entry = counters.find(&loop);
+    return entry == counters.end() ? ValueType::Double : entry->second;
+  }
+};
+
+// Prove which values of `fn` are integers or booleans. Parameters, calls and
+// the function's result stay doubles; shared subtrees are left as doubles as
+// they may be reached under different bindings of their variables.
+TypeInfo inferTypes(FunctionDefinition &fn);
+
+} // namespace ast
+
+#endif // AST_TYPES_H_
@@ -0,0 +1,104 @@
+#ifndef AST_VISITOR_H_
+#define AST_VISITOR_H_
+
+#include "ast/ast.hpp"
+#include <algorithm>
+#include <concepts>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace ast {
+
+// Dispatch on the kind of an expression. The visitor provides one
+// operator() per node type (or a generic one); the call is resolved
+// statically and compiles down to a switch over the variant index.
+template <typename Visitor, typename E>
+  requires std::same_as<std::remove_const_t<E>, Expr>
+decltype(auto) visit(Visitor &&visitor, E &expr) {
+  return std::visit(std::forward<Visitor>(visitor), expr.node);
+}
+
+// Build an ad-hoc visitor out of lambdas
+template <typename... Fs> struct overloaded : Fs... {
+  using Fs::operator()...;
+};
+template <typename... Fs> overloaded(Fs...) -> overloaded<Fs...>;
+
+// Call `fn` on every direct child slot of `expr`, in source order. The
+// slot is passed as an ExprPtr& so passes may replace children in place.
+// A SharedExpr has no child slot: passes that want to look inside shared
+// subtrees do so explicitly, once per subtree rather than once per use.
+template <typename Fn> void forEachChild(Expr &expr, Fn &&fn) {
+  visit(overloaded{
+            [](NumberExpr &) {},
+            [](VariableExpr &) {},
+            [&](BinaryExpr &node) {
+              fn(node.left);
+              fn(node.right);
+            },
+            [&](CallExpr &node) {
+              for (auto &arg : node.args)
+                fn(arg);
+            },
+            [&](IfExpr &node) {
+              fn(node.Cond);
+              fn(node.Then);
+              fn(node.Else);
+            },
+            [&](ForExpr &node) {
+              fn(node.Start);
+              fn(node.End);
+              if (node.Step)
+                fn(node.Step);
+              fn(node.Body);
+            },
+            [](SharedExpr &) {},
+        },
+        expr);
+}
+
+// Call `fn` on `root` and every node below it, children before their parent,
+// using an explicit stack instead of recursion. A shared subtree is walked the
+// first time it is reached, just before the SharedExpr referring to it; the
+// subtrees recorded in `seen` are not walked again.
+template <typename Fn>
+void postOrder(Expr &root, Fn &&fn,
+               std::unordered_set<const Expr *> &seen) {
+  struct Frame {
+    Expr *expr;
+    bool expanded;
+  };
+  std::vector<Frame> work = {{&root, false}};
+
+  while (!work.empty()) {
+    auto [expr, expanded] = work.back();
+    work.pop_back();
+    if (expanded) {
+      fn(*expr);
+      continue;
+    }
+
+    work.push_back({expr, true});
+    if (auto *shared = expr->getIf<SharedExpr>()) {
+      if (seen.insert(shared->expr.get()).second)
+        work.push_back({shared->expr.get(), false});
+      continue;
+    }
+    // Reversed so that children come off the stack in source order
+    size_t first = work.size();
+    forEachChild(*expr,
+                 [&](ExprPtr &child) { work.push_back({child.get(), false}); });
+    std::reverse(work.begin() + first, work.end());
+  }
+}
+
+template <typename Fn> void postOrder(Expr &root, Fn &&fn) {
+  std::unordered_set<const Expr *> seen;
+  postOrder(root, std::forward<Fn>(fn), seen);
+}
+
+} // namespace ast
+
+#endif // AST_VISITOR_H_
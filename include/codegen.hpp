@@ -3,25 +3,101 @@
 
 #include "llvm/Analysis/CGSCCPassManager.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/FMF.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
+#include "report.hpp"
+#include <cstdint>
+
+namespace llvm {
+
+class TargetMachine;
+
+}
 
 namespace ast {
 
 class CompilationUnit;
+class FunctionPrototype;
 
 }
 
 namespace codegen {
 
+// Name given to the functions wrapping top-level expressions
+constexpr const char *AnonExprName = "__anon_expr";
+// Suffix of the batch entry point of a function (see addBatchEntry)
+constexpr const char *BatchSuffix = ".batch";
+
+// Signature of a batch entry point: out[i] = f(columns[0][i], ...) for
+// every row i < rows
+using BatchEntry = void(const double *const *columns, double *out,
+                        uint64_t rows);
+
+struct Options {
+  // Relaxed floating-point semantics put on every generated FP operation and
+  // mirrored in the function attributes the backend looks at
+  llvm::FastMathFlags FastMath;
+  // CPU to tune and select instructions for; "native" detects the host CPU
+  // and everything it supports
+  std::string CPU = "native";
+  // Extra features on top of the CPU's, e.g. "+avx2" or "-fma"
+  std::vector<std::string> Features;
+  // Vector math library the vectoriser may call for vectorised libm
+  // functions, e.g. a sin() loop becoming 4-wide libmvec calls
+  llvm::TargetLibraryInfoImpl::VectorLibrary VecLib =
+      llvm::TargetLibraryInfoImpl::NoLibrary;
+  // Lower values proven integral or boolean to i64 and i1 instead of double
+  bool InferTypes = true;
+  // Record what each optimisation pass does to each function (see
+  // report::OptReport)
+  bool OptReport = false;
+  // Line tables mapping generated code back to the .k source
+  bool DebugInfo = false;
+  // Keep a frame pointer in every function, for profilers that unwind with
+  // it
+  bool FramePointers = false;
+  // Make JIT-compiled code known to perf: jitdump files for `perf inject`,
+  // and/or a /tmp/perf-<pid>.map symbol map
+  bool PerfJITDump = false;
+  bool PerfMap = false;
+  // In JIT sessions, recompile a function at O3 in the background once it
+  // has been called this many times; 0 never does
+  uint64_t TierUpCalls = 0;
+  // For -eval and kaleidoscope::Engine, compile each function on its first
+  // call rather than a whole module on its first lookup, with the functions
+  // it calls compiled speculatively on up to this many threads; 0 compiles
+  // modules whole
+  unsigned SpeculativeThreads = 0;
+};
+
 struct LLVMCodegenCtx {
+  Options Opts;
+  // Machine the module is generated for, if any
+  llvm::TargetMachine *TM = nullptr;
+  // Set with Options::OptReport; outlives the pass objects and contexts
+  // reporting to it
+  std::unique_ptr<report::OptReport> Report;
+
   // Basic codegen objects
   std::unique_ptr<llvm::LLVMContext> Context;
   std::unique_ptr<llvm::IRBuilder<>> Builder;
   std::unique_ptr<llvm::Module> Module;
   std::map<std::string, llvm::Value *> NamedValues;
+  // With Options::DebugInfo, the current module's debug info
+  std::unique_ptr<llvm::DIBuilder> DIB;
+  llvm::DICompileUnit *DICU = nullptr;
+  // Every function that can be called, whether or not the current module
+  // defines it yet; calls to the others are emitted against a declaration
+  std::map<std::string, const ast::FunctionPrototype *> FunctionProtos;
+  // Externs standing for a libm function, called as the LLVM intrinsic
+  std::map<std::string, llvm::Intrinsic::ID> MathIntrinsics;
   // Optimisation pass objects
   std::unique_ptr<llvm::FunctionPassManager> FPM;
   std::unique_ptr<llvm::LoopAnalysisManager> LAM;
@@ -31,9 +107,69 @@ struct LLVMCodegenCtx {
   std::unique_ptr<llvm::ModulePassManager> MPM;
   std::unique_ptr<llvm::PassInstrumentationCallbacks> PIC;
   std::unique_ptr<llvm::StandardInstrumentations> SI;
+  // Analyses registered by the builder refer back to it
+  std::unique_ptr<llvm::PassBuilder> PB;
+  // Library functions of the target, with the vector library's variants
+  std::unique_ptr<llvm::TargetLibraryInfoImpl> TLII;
 };
 
-void codegen(ast::CompilationUnit *ast);
+// Fresh context with an empty module called `moduleName` and the pass and
+// analysis managers set up
+std::unique_ptr<LLVMCodegenCtx>
+createContext(const std::string &moduleName, const Options &options = {},
+              llvm::TargetMachine *tm = nullptr);
+
+// Give the context a new LLVMContext, builder and empty module, e.g. once the
+// previous module has been handed over to a JIT along with its LLVMContext.
+// Options, pass pipelines and known prototypes carry over.
+void resetContext(LLVMCodegenCtx &llctx, const std::string &moduleName);
+
+// Replace the context's module with an empty one called `name`, which is
+// also the source file its debug info refers to
+void startModule(LLVMCodegenCtx &llctx, const std::string &name);
+
+// Complete the current module once all its functions have been generated
+void finishModule(LLVMCodegenCtx &llctx);
+
+// The function called `name` in the current module, declaring it from its
+// known prototype if needed; nullptr if no such function is known
+llvm::Function *getFunction(LLVMCodegenCtx *llctx, const std::string &name);
+
+// Whether extern `proto` is a libm function with its libm signature, taking
+// as many doubles as it does (see declareExtern)
+bool isMathFunction(const ast::FunctionPrototype &proto);
+// Whether calls to `name` are vector operations generated inline, when no
+// function of that name is defined
+bool isVectorBuiltin(const std::string &name);
+
+// Make an extern callable. Known libm functions (sqrt, exp, sin, pow, ...)
+// become calls to the matching LLVM intrinsic so they are constant folded,
+// hoisted and vectorised; anything else is left for the linker.
+void declareExtern(LLVMCodegenCtx *llctx, const ast::FunctionPrototype *proto);
+
+// Generate and optimise a module for the compilation unit. When a target
+// machine is given the module is laid out for it, functions carry its CPU
+// and features, and the optimiser uses its cost model. Returns nullptr if
+// any function failed to generate.
+std::unique_ptr<LLVMCodegenCtx>
+codegen(ast::CompilationUnit *ast, const Options &options = {},
+        llvm::TargetMachine *tm = nullptr);
+
+// Add `void f.batch(const double **columns, double *out, i64 rows)` calling
+// `f` on every row of its argument columns. Once `f` is inlined into it, the
+// loop is left to the vectoriser.
+llvm::Function *addBatchEntry(LLVMCodegenCtx &llctx, llvm::Function &f);
+
+// Generate every unit, link them into a single module and optimise it as a
+// closed world: only `entryPoints` and the top-level expressions stay
+// externally visible, everything else is internalised and left to the
+// interprocedural passes (inlining, constant propagation, dead function
+// elimination). Returns nullptr if any unit failed to generate or link.
+std::unique_ptr<LLVMCodegenCtx>
+codegenWholeProgram(const std::vector<ast::CompilationUnit *> &units,
+                    const std::vector<std::string> &entryPoints,
+                    const Options &options = {},
+                    llvm::TargetMachine *tm = nullptr);
 
 } // namespace codegen
 
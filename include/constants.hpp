@@ -1,10 +1,18 @@
 #ifndef CONSTANTS_H_
 #define CONSTANTS_H_
 
+#include "ast/printer.hpp"
 #include "logger.hpp"
+#include "llvm/Support/CommandLine.h"
 
-extern llvm::cl::opt<std::string> InputFilename;
+extern llvm::cl::list<std::string> InputFilenames;
 extern llvm::cl::opt<std::string> OutputFilename;
-extern llvm::cl::opt<log::LoggingLevel> LoggingLevel;
+extern llvm::cl::opt<ast::DumpFormat> DumpAst;
+extern llvm::cl::opt<bool> Shared;
+extern llvm::cl::opt<bool> HashCons;
+extern llvm::cl::opt<unsigned> Specialise;
+extern llvm::cl::opt<bool> PruneUnreachable;
+extern llvm::cl::list<std::string> EntryPoints;
+extern llvm::cl::opt<std::string> OptReport;
 
 #endif // CONSTANTS_H_
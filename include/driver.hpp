@@ -0,0 +1,82 @@
+#ifndef DRIVER_H_
+#define DRIVER_H_
+
+#include "codegen.hpp"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace driver {
+
+std::unique_ptr<llvm::MemoryBuffer> read_file(std::string filepath);
+
+// Lex, parse and generate code for a single source buffer. If outputPath is
+// not empty a native object file is written there.
+int compile(const llvm::MemoryBuffer *buf, std::string filename,
+            const codegen::Options &options,
+            const std::string &outputPath = "");
+
+int compileFile(const std::string &filename, const codegen::Options &options,
+                const std::string &outputPath = "");
+
+// Like compileFile, but lexing, parsing and codegen run concurrently on one
+// definition at a time, connected by bounded queues. Tokens and ASTs stay
+// bounded: each definition's AST is freed once its IR has been generated and
+// optimised. The IR itself stays in one module until the object is written,
+// so that part of memory still grows with the source. Functions must be
+// defined before they are called.
+int compilePipelined(const std::string &filename,
+                     const codegen::Options &options,
+                     const std::string &outputPath = "");
+
+// Interactive session on stdin: each line's definitions are compiled into a
+// JIT and its top-level expressions run and printed straight away
+int repl(const codegen::Options &options);
+
+struct BatchOptions {
+  codegen::Options codegen;
+  // Worker threads, 0 for one per hardware thread
+  unsigned jobs = 0;
+  // Directory the objects are written to, created if missing. When empty,
+  // each object is written next to its input
+  std::string outputDir;
+};
+
+// Input paths listed one per line; blank lines and '#' comments are skipped
+std::vector<std::string> readManifest(const std::string &path);
+
+// Compile every input independently on a work-stealing pool, writing one
+// object per input. Returns non-zero if any input failed.
+int compileBatch(const std::vector<std::string> &inputs,
+                 const BatchOptions &options);
+
+// Compile all inputs as one program into a single object at `outputPath`.
+// Functions other than `entryPoints` and top-level expressions are private to
+// the program, so they can be inlined across files or dropped.
+int compileWholeProgram(const std::vector<std::string> &inputs,
+                        const std::vector<std::string> &entryPoints,
+                        const codegen::Options &options,
+                        const std::string &outputPath);
+
+// Compile `filename` and evaluate `function` on every row of the argument
+// columns (raw little-endian doubles, one file per argument), writing the
+// results to the column file `outputPath` (see runner::evaluate). A function
+// without arguments is evaluated `rows` times.
+int run(const std::string &filename, const std::string &function,
+        const std::vector<std::string> &columns,
+        const std::string &outputPath, uint64_t rows, unsigned jobs,
+        const codegen::Options &options);
+
+// Compile `filename` and evaluate its top-level expressions concurrently on
+// `jobs` threads (0 for one per hardware thread), printing their results to
+// stdout in source order. Expressions must not depend on each other's side
+// effects, which holds for everything but externs such as putchard. With
+// Options::SpeculativeThreads, functions are compiled on their first call by
+// jit::createSpeculativeJIT instead of all before evaluation starts.
+int evaluate(const std::string &filename, unsigned jobs,
+             const codegen::Options &options);
+
+} // namespace driver
+
+#endif // DRIVER_H_
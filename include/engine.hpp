@@ -0,0 +1,70 @@
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include "codegen.hpp"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Target/TargetMachine.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace kaleidoscope {
+
+// Compiler and JIT for use inside another process. Every compile() call
+// yields a module whose scalar functions can be looked up as native function
+// pointers (`double(double, ...)`) until the module is released. Functions
+// passing vectors have no such signature and cannot be looked up.
+//
+// All members may be called from several threads at once. Function names
+// are shared by all live modules; top-level expressions are ignored.
+class Engine {
+public:
+  using ModuleHandle = uint64_t;
+
+  // nullptr (after logging) if the host cannot JIT
+  static std::unique_ptr<Engine> create(const codegen::Options &options = {});
+
+  // Compile source text; std::nullopt (after logging) on error
+  std::optional<ModuleHandle> compile(std::string_view source,
+                                      const std::string &name = "<source>");
+
+  // Address of a scalar function of any live module; nullptr (after logging)
+  // if there is none or it passes vectors
+  void *lookup(const std::string &name);
+  template <typename Fn> Fn *lookupAs(const std::string &name) {
+    return reinterpret_cast<Fn *>(lookup(name));
+  }
+
+  // Free a module's code; pointers looked up from it become invalid
+  bool release(ModuleHandle module);
+
+  // Compile source text into a shared library at `libraryPath` and a C
+  // header declaring its functions at `headerPath`
+  bool emitSharedLibrary(std::string_view source,
+                         const std::string &libraryPath,
+                         const std::string &headerPath);
+
+private:
+  codegen::Options options;
+  std::unique_ptr<llvm::TargetMachine> tm;
+  std::unique_ptr<llvm::orc::LLJIT> lljit;
+  // lljit itself when it compiles lazily (Options::SpeculativeThreads)
+  llvm::orc::LLLazyJIT *lazyjit = nullptr;
+
+  // Guards the module table and object emission
+  std::mutex mutex;
+  std::map<ModuleHandle, llvm::orc::ResourceTrackerSP> modules;
+  // Functions passing vectors, and the module defining each
+  std::map<std::string, ModuleHandle> vectorFunctions;
+  ModuleHandle nextHandle = 1;
+
+  Engine() = default;
+};
+
+} // namespace kaleidoscope
+
+#endif // ENGINE_H_
@@ -0,0 +1,139 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "ast/ast.hpp"
+#include "codegen.hpp"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "scheduler.hpp"
+#include "llvm/Target/TargetMachine.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace jit {
+
+// LLJIT generating code for the machine's triple, CPU and features, whose
+// programs can call into the host process (e.g. libm) and, as the options
+// ask, are announced to perf; nullptr (after logging) on failure
+std::unique_ptr<llvm::orc::LLJIT>
+createLLJIT(const llvm::TargetMachine &tm,
+            const codegen::Options &options = {});
+
+// Like createLLJIT, but compiling lazily, one function at a time on its first
+// call, on Options::SpeculativeThreads threads. Compiling a function starts
+// compiling the functions it calls in the background, so a chain of first
+// calls waits for about one compile rather than one per level.
+std::unique_ptr<llvm::orc::LLLazyJIT>
+createSpeculativeJIT(const llvm::TargetMachine &tm,
+                     const codegen::Options &options);
+
+// Log and consume a JIT error; true if there was none
+bool check(llvm::Error err);
+
+// The context's module, with its LLVMContext, ready to hand to a JIT. The
+// context is reset to an empty module called `next` first, so none of its
+// cached analyses or debug info still point into a module that the JIT may
+// be compiling on another thread.
+llvm::orc::ThreadSafeModule takeModule(codegen::LLVMCodegenCtx &llctx,
+                                       const std::string &next);
+
+// In-process JIT for interactive sessions. Every input is generated into its
+// own module on a persistent codegen context and compiled on its own, so the
+// cost of an input does not depend on how much the session already holds.
+//
+// Named functions are called through a stub that points at the latest
+// compiled body, which lets a definition be replaced without recompiling its
+// callers; the replaced body is freed. Top-level expressions are freed as
+// soon as they have run.
+//
+// With Options::TierUpCalls, every body counts its calls. The call that
+// reaches the threshold queues the function for a background thread, which
+// compiles it again at O3 and points its stub at the result; running code
+// carries on and only later calls take the optimised body.
+class KaleidoscopeJIT {
+public:
+  // nullptr (after logging) if the host cannot JIT
+  static std::unique_ptr<KaleidoscopeJIT>
+  create(const codegen::Options &options = {});
+  ~KaleidoscopeJIT();
+
+  // Compile a named function, replacing any earlier definition with the same
+  // number of arguments
+  bool addDefinition(std::unique_ptr<ast::FunctionDefinition> fn);
+
+  // Make a function of the host process (e.g. from libm) callable
+  bool addExtern(std::unique_ptr<ast::FunctionPrototype> proto);
+
+  // Compile and run a top-level expression
+  std::optional<double> evaluate(std::unique_ptr<ast::FunctionDefinition> expr);
+
+private:
+  // Call counter of a body, incremented by its code
+  struct Tier {
+    std::atomic<uint64_t> calls = 0;
+    KaleidoscopeJIT *jit;
+    std::string name;
+    // Input that defined the body
+    unsigned input;
+  };
+
+  struct Definition {
+    // Owns the current body
+    llvm::orc::ResourceTrackerSP tracker;
+    // Owns its O3 recompilation, once there is one
+    llvm::orc::ResourceTrackerSP optimised;
+    size_t arity;
+    unsigned input;
+    // Kept for recompiling the body
+    std::unique_ptr<ast::FunctionDefinition> source;
+    std::unique_ptr<Tier> tier;
+  };
+
+  // A body that reached the call threshold
+  struct TierUpRequest {
+    std::string name;
+    unsigned input;
+  };
+
+  std::unique_ptr<llvm::TargetMachine> tm;
+  std::unique_ptr<llvm::orc::LLJIT> lljit;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+  std::unique_ptr<codegen::LLVMCodegenCtx> llctx;
+
+  // Prototypes of every extern, for declaring them in later inputs
+  std::map<std::string, std::unique_ptr<ast::FunctionPrototype>> prototypes;
+  std::map<std::string, Definition> definitions;
+  unsigned inputs = 0;
+
+  // Guards the definitions and the prototypes known to llctx against the
+  // tier-up thread
+  std::mutex mutex;
+  // Codegen context of the tier-up thread
+  std::unique_ptr<codegen::LLVMCodegenCtx> optctx;
+  scheduler::BoundedQueue<TierUpRequest> hot{1024};
+  std::thread optimiser;
+
+  KaleidoscopeJIT() = default;
+
+  // Called with its Tier by a body that reached the call threshold
+  static void requestTierUp(void *tier);
+  // Body of the tier-up thread
+  void optimise();
+  // Recompile one definition at O3 and switch its stub to the result
+  void tierUp(const TierUpRequest &request);
+
+  // Generate `fn` into the current module and run the function passes on
+  // it; with a `tier`, the body counts its calls there
+  llvm::Function *generate(ast::FunctionDefinition &fn, Tier *tier = nullptr);
+  // Hand the current module to the JIT under `tracker` and start a new one
+  bool submit(llvm::orc::ResourceTrackerSP tracker);
+};
+
+} // namespace jit
+
+#endif // JIT_H_
@@ -0,0 +1,51 @@
+/* C interface to the in-process compiler, see engine.hpp */
+#ifndef KALEIDOSCOPE_H_
+#define KALEIDOSCOPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kaleidoscope_engine kaleidoscope_engine;
+/* Identifies the functions of one compile call; 0 is never a valid module */
+typedef uint64_t kaleidoscope_module;
+
+/* How much the library logs to stdout: 0 errors only (the default),
+ * 1 warnings, 2 information, 3 debugging, 4 tracing */
+void kaleidoscope_set_log_level(int level);
+
+/* Engine generating code for the host CPU; NULL on failure */
+kaleidoscope_engine *kaleidoscope_engine_create(void);
+/* Like kaleidoscope_engine_create, but compiling each function on its first
+ * call, with the functions it calls compiled speculatively on up to
+ * `threads` background threads */
+kaleidoscope_engine *kaleidoscope_engine_create_speculative(unsigned threads);
+void kaleidoscope_engine_destroy(kaleidoscope_engine *engine);
+
+/* Compile `length` bytes of source; 0 on error */
+kaleidoscope_module kaleidoscope_compile(kaleidoscope_engine *engine,
+                                         const char *source, size_t length);
+
+/* Address of a compiled function, to be cast to double (*)(double, ...);
+ * NULL if no live module defines it, or if it passes vectors */
+void *kaleidoscope_lookup(kaleidoscope_engine *engine, const char *name);
+
+/* Free a module's code; returns 0 on success */
+int kaleidoscope_release(kaleidoscope_engine *engine,
+                         kaleidoscope_module module);
+
+/* Build a shared library from source, plus a header declaring its
+ * functions; returns 0 on success */
+int kaleidoscope_emit_shared_library(kaleidoscope_engine *engine,
+                                     const char *source, size_t length,
+                                     const char *library_path,
+                                     const char *header_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KALEIDOSCOPE_H_ */
@@ -18,6 +18,8 @@ enum class TokenKind {
   Comma,
   Semicolon,
   Assignment,
+  Colon,
+  At,
   // Keywords
   Def,
   Extern,
@@ -29,14 +31,23 @@ enum class TokenKind {
   // Primary
   Identifier,
   Number,
+  // Returned by token streams past the last token
+  EndOfInput,
 };
 
 using OptionalTokenData = std::optional<std::variant<std::string, double>>;
 
+// 1-based position in the source; line 0 means unknown
+struct SourceLocation {
+  unsigned line = 0;
+  unsigned column = 0;
+};
+
 class Token {
 public:
   TokenKind kind;
   OptionalTokenData data;
+  SourceLocation loc;
 
   Token(TokenKind kind) : kind(kind), data(std::nullopt) {}
   Token(TokenKind kind, OptionalTokenData data) : kind(kind), data(data) {}
@@ -49,6 +60,26 @@ public:
   int precedence();
 };
 
+// Produces the tokens of a buffer one at a time, so callers can start on the
+// first tokens before the rest of the input has been looked at
+class Lexer {
+public:
+  explicit Lexer(const llvm::MemoryBuffer *buffer);
+
+  // The next token, or std::nullopt at the end of the input or on an error
+  std::optional<Token> next();
+  // Set once next() met a character it could not tokenize
+  const std::optional<std::string> &error() const { return this->err; }
+
+private:
+  const char *pos;
+  const char *end;
+  std::optional<std::string> err;
+  // For the locations of tokens
+  unsigned line = 1;
+  const char *lineStart;
+};
+
 using TokenizeResult = std::variant<std::deque<Token>, std::string>;
 
 TokenizeResult tokenize(const llvm::MemoryBuffer *buffer);
@@ -72,6 +103,8 @@ template <> struct std::formatter<Token> {
       TOKEN_FORMAT_CASE(Comma)
       TOKEN_FORMAT_CASE(Semicolon)
       TOKEN_FORMAT_CASE(Assignment)
+      TOKEN_FORMAT_CASE(Colon)
+      TOKEN_FORMAT_CASE(At)
       TOKEN_FORMAT_CASE(Def)
       TOKEN_FORMAT_CASE(Extern)
       TOKEN_FORMAT_CASE(If)
@@ -79,6 +112,7 @@ template <> struct std::formatter<Token> {
       TOKEN_FORMAT_CASE(Else)
       TOKEN_FORMAT_CASE(For)
       TOKEN_FORMAT_CASE(In)
+      TOKEN_FORMAT_CASE(EndOfInput)
     case TokenKind::Identifier:
       result = "Identifier(" + std::get<std::string>(token.data.value()) + ")";
       break;
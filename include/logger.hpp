@@ -1,39 +1,86 @@
 #ifndef LOGGER_H_
 #define LOGGER_H_
 
-#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+
+// Highest level that is compiled into the binary at all. Anything above it is
+// folded away by the compiler, arguments included.
+#ifndef KALEIDOSCOPE_LOG_MAX_LEVEL
+#define KALEIDOSCOPE_LOG_MAX_LEVEL trace
+#endif
 
 namespace log {
 
 enum LoggingLevel { error, warn, info, debug, trace };
 
+constexpr LoggingLevel MaxLevel = KALEIDOSCOPE_LOG_MAX_LEVEL;
+
+// Records above this level are dropped. Only errors are logged until the host
+// raises it, e.g. the driver from its -log option. The library registers no
+// command line options of its own, so hosts can use any names they like.
+extern std::atomic<LoggingLevel> Level;
+
+inline LoggingLevel currentLevel() {
+  return Level.load(std::memory_order_relaxed);
+}
+inline void setLevel(LoggingLevel level) {
+  Level.store(level, std::memory_order_relaxed);
 }
 
-extern llvm::cl::opt<log::LoggingLevel> LoggingLevel;
+inline bool enabled(LoggingLevel level) {
+  return level <= MaxLevel && level <= currentLevel();
+}
 
-#define ERROR(str)                                                             \
-  if (LoggingLevel >= log::error) {                                            \
-    llvm::outs() << "[Error] " << str << '\n';                                 \
-  }
+// A single log line. Text is formatted into a per-thread buffer which is
+// handed to the shared output in whole lines, so records from different
+// threads never interleave mid-line. Only records too large to buffer (such
+// as AST dumps) are passed on in chunks.
+class Record {
+public:
+  Record(LoggingLevel level, bool prefix = true);
+  ~Record();
 
-#define WARN(str)                                                              \
-  if (LoggingLevel >= log::warn) {                                             \
-    llvm::outs() << "[Error] " << str << '\n';                                 \
-  }
+  llvm::raw_ostream &stream();
 
-#define INFO(str)                                                              \
-  if (LoggingLevel >= log::info) {                                             \
-    llvm::outs() << "[Info] " << str << '\n';                                  \
+  template <typename T> Record &operator<<(const T &value) {
+    stream() << value;
+    return *this;
   }
 
-#define DEBUG(str)                                                             \
-  if (LoggingLevel >= log::debug) {                                            \
-    llvm::outs() << "[Debug] " << str << '\n';                                 \
-  }
+private:
+  LoggingLevel level;
+};
 
-#define TRACE(str)                                                             \
-  if (LoggingLevel >= log::trace) {                                            \
-    llvm::outs() << "[Trace] " << str << '\n';                                 \
+// Structured key=value field, e.g. TRACE("token" << log::kv("pos", pos))
+template <typename T> struct Field {
+  llvm::StringRef key;
+  const T &value;
+};
+
+template <typename T> Field<T> kv(llvm::StringRef key, const T &value) {
+  return Field<T>{key, value};
+}
+
+template <typename T>
+llvm::raw_ostream &operator<<(llvm::raw_ostream &os, const Field<T> &field) {
+  return os << ' ' << field.key << '=' << field.value;
+}
+
+// Write out whatever the calling thread has buffered so far
+void flush();
+
+} // namespace log
+
+#define LOG_AT(level, str)                                                     \
+  if (log::enabled(level)) {                                                   \
+    log::Record(level) << str;                                                 \
   }
 
+#define ERROR(str) LOG_AT(log::error, str)
+#define WARN(str) LOG_AT(log::warn, str)
+#define INFO(str) LOG_AT(log::info, str)
+#define DEBUG(str) LOG_AT(log::debug, str)
+#define TRACE(str) LOG_AT(log::trace, str)
+
 #endif // LOGGER_H_
@@ -0,0 +1,75 @@
+#ifndef REPORT_H_
+#define REPORT_H_
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace report {
+
+// Records what every optimisation pass did to each function: instruction,
+// basic block and call counts before and after the pass and the time it
+// took, plus the optimiser's remarks about missed inlining and
+// vectorisation. Written out as one JSON document.
+class OptReport {
+public:
+  // Instrumentation to build the pass pipelines with; passes run through
+  // analysis managers set up without it are not recorded
+  llvm::PassInstrumentationCallbacks &instrumentation() { return callbacks; }
+
+  // Collect the remarks emitted in `context`
+  void attach(llvm::LLVMContext &context);
+
+  void write(llvm::raw_ostream &os) const;
+
+  struct Counts {
+    size_t instructions = 0;
+    size_t blocks = 0;
+    size_t calls = 0;
+  };
+
+  struct PassRun {
+    std::string pass;
+    Counts before;
+    Counts after;
+    double seconds;
+  };
+
+  struct Remark {
+    std::string pass;
+    std::string name;
+    std::string message;
+  };
+
+  struct FunctionReport {
+    std::vector<PassRun> passes;
+    std::vector<Remark> remarks;
+  };
+
+  void addRemark(const std::string &function, Remark remark) {
+    functions[function].remarks.push_back(std::move(remark));
+  }
+
+private:
+  llvm::PassInstrumentationCallbacks callbacks;
+  std::map<std::string, FunctionReport> functions;
+
+  // Passes started and not finished yet, innermost last
+  struct Running {
+    std::map<std::string, Counts> before;
+    std::chrono::steady_clock::time_point start;
+  };
+  std::vector<Running> running;
+
+  bool registered = false;
+  void registerCallbacks();
+  void finish(llvm::StringRef pass, std::map<std::string, Counts> after);
+};
+
+} // namespace report
+
+#endif // REPORT_H_
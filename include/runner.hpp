@@ -0,0 +1,26 @@
+#ifndef RUNNER_H_
+#define RUNNER_H_
+
+#include "codegen.hpp"
+#include <string>
+#include <vector>
+
+namespace runner {
+
+// Evaluate a compiled function over columns of raw little-endian doubles,
+// one file per argument, into an output column file of the same length. A
+// function without arguments has no input columns and is evaluated `rows`
+// times instead; `rows` is ignored otherwise.
+// Files are memory-mapped and fed to `entry` in cache-sized chunks: no row is
+// parsed or copied. Each of the `jobs` threads (0 for one per hardware
+// thread) is pinned to a CPU and handles one contiguous range of rows, so the
+// output pages it writes are placed on its own NUMA node. Returns false
+// (after logging) on error.
+bool evaluate(codegen::BatchEntry *entry,
+              const std::vector<std::string> &inputs,
+              const std::string &outputPath, uint64_t rows = 0,
+              unsigned jobs = 0);
+
+} // namespace runner
+
+#endif // RUNNER_H_
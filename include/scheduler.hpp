@@ -0,0 +1,112 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace scheduler {
+
+// Fixed-size thread pool where every worker owns a task deque. Workers run
+// their own tasks newest-first and, once out of work, steal the oldest task
+// from a sibling. Tasks submitted from inside a task land on the submitting
+// worker's deque, which keeps related work on the same core.
+class WorkStealingPool {
+public:
+  using Task = std::function<void()>;
+
+  // 0 threads means one per hardware thread
+  explicit WorkStealingPool(unsigned threads = 0);
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  void submit(Task task);
+  // Block until every submitted task has finished
+  void wait();
+
+  unsigned size() const { return workers.size(); }
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+
+  // Tasks sitting in some deque, counted down under the deque's lock / tasks
+  // not yet finished
+  std::atomic<size_t> queued = 0;
+  std::atomic<size_t> unfinished = 0;
+  std::atomic<unsigned> nextWorker = 0;
+  bool stopping = false;
+
+  std::mutex stateMutex;
+  std::condition_variable workAvailable;
+  std::condition_variable allDone;
+
+  void run(unsigned self);
+  bool popLocal(unsigned self, Task &task);
+  bool steal(unsigned self, Task &task);
+};
+
+// Blocking FIFO of at most `capacity` items connecting two pipeline stages.
+// Either side may close it: producers then stop, consumers drain what is left.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  // Blocks while the queue is full; false if it has been closed
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+    if (closed)
+      return false;
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty; std::nullopt once closed and drained
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+    if (items.empty())
+      return std::nullopt;
+    T item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return item;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  std::deque<T> items;
+  bool closed = false;
+
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+};
+
+} // namespace scheduler
+
+#endif // SCHEDULER_H_
@@ -0,0 +1,35 @@
+#ifndef TARGET_H_
+#define TARGET_H_
+
+#include "codegen.hpp"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+#include <memory>
+#include <string>
+
+namespace target {
+
+// Register the native target with LLVM. Safe to call more than once.
+void initialise();
+
+// Target machine for the host triple and the CPU/features chosen in
+// `options`, honouring its relaxed FP semantics; nullptr (after logging) on
+// failure
+std::unique_ptr<llvm::TargetMachine>
+createTargetMachine(const codegen::Options &options = {});
+
+// Stamp the module with the machine's triple and data layout
+void configureModule(llvm::Module &module, const llvm::TargetMachine &tm);
+
+// Write the module out as a native object file
+bool emitObject(llvm::Module &module, llvm::TargetMachine &tm,
+                const std::string &path);
+
+// Write the module out as a position-independent shared library, linked by
+// the system C compiler driver (`cc`)
+bool emitSharedLibrary(llvm::Module &module, llvm::TargetMachine &tm,
+                       const std::string &path);
+
+} // namespace target
+
+#endif // TARGET_H_
@@ -0,0 +1,64 @@
+#include "ast/ast.hpp"
+#include "ast/visitor.hpp"
+#include <format>
+#include <vector>
+
+std::string ast::typeName(unsigned lanes) {
+  return lanes == 1 ? "double" : std::format("vec{}", lanes);
+}
+
+std::vector<std::string> ast::annotations(const FunctionHints &hints) {
+  std::vector<std::string> out;
+  if (hints.alwaysInline)
+    out.push_back("@inline");
+  if (hints.noInline)
+    out.push_back("@noinline");
+  if (hints.hot)
+    out.push_back("@hot");
+  if (hints.cold)
+    out.push_back("@cold");
+  if (hints.pure)
+    out.push_back("@pure");
+  return out;
+}
+
+std::vector<std::string> ast::annotations(const LoopHints &hints) {
+  std::vector<std::string> out;
+  if (hints.unroll)
+    out.push_back(std::format("@unroll({})", hints.unroll));
+  if (hints.noUnroll)
+    out.push_back("@nounroll");
+  if (hints.vectorize)
+    out.push_back(std::format("@vectorize({})", hints.vectorize));
+  return out;
+}
+
+ast::Expr::~Expr() {
+  // Children are detached into a worklist before their parent goes away, so
+  // each node is destroyed without any children left to recurse into
+  std::vector<ExprPtr> owned;
+  std::vector<std::shared_ptr<Expr>> shared;
+  auto detach = [&](Expr &expr) {
+    forEachChild(expr, [&](ExprPtr &child) {
+      if (child)
+        owned.push_back(std::move(child));
+    });
+    // Only the last user of a shared subtree tears it down
+    if (auto *node = expr.getIf<SharedExpr>();
+        node && node->expr.use_count() == 1)
+      shared.push_back(std::move(node->expr));
+  };
+
+  detach(*this);
+  while (!owned.empty() || !shared.empty()) {
+    if (!owned.empty()) {
+      ExprPtr expr = std::move(owned.back());
+      owned.pop_back();
+      detach(*expr);
+    } else {
+      std::shared_ptr<Expr> expr = std::move(shared.back());
+      shared.pop_back();
+      detach(*expr);
+    }
+  }
+}
@@ -0,0 +1,140 @@
+#include "ast/ast.hpp"
+#include "ast/passes.hpp"
+#include "ast/visitor.hpp"
+#include "codegen.hpp"
+#include "logger.hpp"
+#include <cmath>
+#include <map>
+#include <optional>
+#include <set>
+#include <utility>
+
+// Counters, steps and bounds up to this magnitude are exact, so adding a
+// step of at least 1 always moves the counter
+constexpr double ExactCounterLimit = 4503599627370496.0; // 2^52
+
+static const ast::Expr &unshared(const ast::Expr &expr) {
+  if (auto *shared = expr.getIf<ast::SharedExpr>())
+    return unshared(*shared->expr);
+  return expr;
+}
+
+static std::optional<double> exactLiteral(const ast::Expr &expr) {
+  auto *number = unshared(expr).getIf<ast::NumberExpr>();
+  if (!number || !(std::abs(number->val) <= ExactCounterLimit))
+    return std::nullopt;
+  return number->val;
+}
+
+static bool isVariable(const ast::Expr &expr, const std::string &name) {
+  auto *variable = unshared(expr).getIf<ast::VariableExpr>();
+  return variable && variable->name == name;
+}
+
+// Whether the loop is bound to end whatever its body does: the counter
+// starts from a literal and moves by a literal step of at least 1 towards a
+// literal bound, as in `for i = 0, i < 100 in ...`
+static bool bounded(const ast::ForExpr &loop) {
+  auto start = exactLiteral(*loop.Start);
+  auto step = loop.Step ? exactLiteral(*loop.Step) : 1.0;
+  auto *cond = unshared(*loop.End).getIf<ast::BinaryExpr>();
+  if (!start || !step || std::abs(*step) < 1 || !cond)
+    return false;
+
+  // The counter must stay on the side of the comparison it starts on
+  const ast::Expr *counter = cond->left.get(), *bound = cond->right.get();
+  bool below = cond->op == ast::OperatorKind::LessThan;
+  if (!below && cond->op != ast::OperatorKind::GreaterThan)
+    return false;
+  if (!isVariable(*counter, loop.VarName)) {
+    std::swap(counter, bound);
+    below = !below;
+  }
+  return isVariable(*counter, loop.VarName) && exactLiteral(*bound) &&
+         (*step > 0) == below;
+}
+
+void ast::inferEffects(const std::vector<CompilationUnit *> &units) {
+  struct Function {
+    FunctionPrototype *proto;
+    std::set<std::string> callees;
+    bool loopsBounded = true;
+  };
+  std::vector<Function> functions;
+  std::map<std::string, FunctionPrototype *> definitions;
+  std::map<std::string, FunctionPrototype *> externs;
+  for (CompilationUnit *cu : units) {
+    for (auto &proto : cu->externs)
+      externs.try_emplace(proto->getName(), proto.get());
+    for (auto &fn : cu->functions) {
+      if (!fn->proto->getName().empty())
+        definitions.try_emplace(fn->proto->getName(), fn->proto.get());
+
+      Function &function = functions.emplace_back(fn->proto.get());
+      postOrder(*fn->body, [&](Expr &expr) {
+        if (auto *call = expr.getIf<CallExpr>())
+          function.callees.insert(call->callee);
+        else if (auto *loop = expr.getIf<ForExpr>())
+          function.loopsBounded &= bounded(*loop);
+      });
+    }
+  }
+
+  // Effects of a callee as currently known. Functions defined in other
+  // modules are unknown and assumed to do anything.
+  auto effectsOf = [&](const std::string &name) -> FunctionEffects {
+    if (auto definition = definitions.find(name);
+        definition != definitions.end())
+      return definition->second->effects;
+    if (auto proto = externs.find(name); proto != externs.end()) {
+      // libm functions touch nothing but errno, which programs cannot read.
+      // Declared with another signature, the name is an ordinary extern.
+      if (proto->second->hints.pure || codegen::isMathFunction(*proto->second))
+        return {true, true};
+      return {};
+    }
+    if (codegen::isVectorBuiltin(name))
+      return {true, true};
+    return {};
+  };
+
+  // Purity is assumed and withdrawn from every caller of something impure,
+  // so recursion alone keeps a function pure. Returning is only granted once
+  // every callee is known to return, which recursion never is.
+  for (Function &function : functions)
+    function.proto->effects = {true, function.proto->hints.pure};
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (Function &function : functions) {
+      // Annotated functions are taken at their word
+      if (function.proto->hints.pure)
+        continue;
+      FunctionEffects &effects = function.proto->effects;
+      bool pure = true, willReturn = function.loopsBounded;
+      for (const std::string &callee : function.callees) {
+        FunctionEffects known = effectsOf(callee);
+        pure &= known.pure;
+        willReturn &= known.willReturn;
+      }
+      if (effects.pure && !pure) {
+        effects.pure = false;
+        changed = true;
+      }
+      if (!effects.willReturn && willReturn) {
+        effects.willReturn = true;
+        changed = true;
+      }
+    }
+  }
+
+  if (log::enabled(log::debug)) {
+    size_t pure = 0, willReturn = 0;
+    for (Function &function : functions) {
+      pure += function.proto->effects.pure;
+      willReturn += function.proto->effects.willReturn;
+    }
+    DEBUG("Inferred effects" << log::kv("functions", functions.size())
+                             << log::kv("pure", pure)
+                             << log::kv("willreturn", willReturn));
+  }
+}
@@ -0,0 +1,75 @@
+#include "ast/ast.hpp"
+#include "ast/passes.hpp"
+#include "ast/visitor.hpp"
+#include "logger.hpp"
+#include "matchit.h"
+#include <optional>
+#include <unordered_set>
+
+// Mirrors the codegen lowering, including fcmp ult being true on NaN.
+// Operators codegen does not lower are not folded either, so a program is
+// rejected the same way whether their operands are literals or not.
+static std::optional<double> evalOperator(ast::OperatorKind op, double l,
+                                          double r) {
+  using namespace matchit;
+  using ast::OperatorKind;
+  using Result = std::optional<double>;
+  return match(op)(
+      pattern | OperatorKind::Plus = [&] { return Result(l + r); },
+      pattern | OperatorKind::Minus = [&] { return Result(l - r); },
+      pattern | OperatorKind::Asterisk = [&] { return Result(l * r); },
+      pattern | OperatorKind::LessThan =
+          [&] { return Result(!(l >= r) ? 1.0 : 0.0); },
+      pattern | _ = [] { return Result(); });
+}
+
+static std::optional<double> literal(const ast::Expr &expr) {
+  if (auto *shared = expr.getIf<ast::SharedExpr>())
+    return literal(*shared->expr);
+  if (auto *number = expr.getIf<ast::NumberExpr>())
+    return number->val;
+  return std::nullopt;
+}
+
+// Replaces `expr` in place by its folded form, if it has one. Nodes are
+// updated in place so shared subtrees change for all their users.
+static void foldNode(ast::Expr &expr) {
+  ast::ExprPtr folded = ast::visit(
+      ast::overloaded{
+          [](ast::BinaryExpr &node) -> ast::ExprPtr {
+            auto l = literal(*node.left), r = literal(*node.right);
+            if (!l || !r)
+              return nullptr;
+            auto value = evalOperator(node.op, *l, *r);
+            if (!value)
+              return nullptr;
+            return ast::make<ast::NumberExpr>(*value);
+          },
+          [](ast::IfExpr &node) -> ast::ExprPtr {
+            auto cond = literal(*node.Cond);
+            if (!cond)
+              return nullptr;
+            // Same test as the fcmp one the condition lowers to
+            return std::move(*cond < 0 || *cond > 0 ? node.Then : node.Else);
+          },
+          [](auto &) -> ast::ExprPtr { return nullptr; },
+      },
+      expr);
+
+  // The old node goes away here; `folded` owns what it keeps of it
+  if (folded)
+    expr.node = std::move(folded->node);
+}
+
+// Bottom-up, so operands are folded before the nodes using them; each shared
+// subtree is folded only once
+void ast::foldConstants(FunctionDefinition &fn) {
+  ast::postOrder(*fn.body, foldNode);
+}
+
+void ast::foldConstants(CompilationUnit &cu) {
+  std::unordered_set<const Expr *> seen;
+  for (auto &fn : cu.functions)
+    ast::postOrder(*fn->body, foldNode, seen);
+  TRACE("Folded constants in " << cu.name);
+}
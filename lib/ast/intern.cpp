@@ -0,0 +1,31 @@
+#include "ast/intern.hpp"
+#include <bit>
+
+std::optional<ast::Interner::Operand>
+ast::Interner::operand(const Expr &expr) {
+  if (auto *number = expr.getIf<NumberExpr>())
+    return std::bit_cast<uint64_t>(number->val);
+  if (auto *variable = expr.getIf<VariableExpr>())
+    return variable->name;
+  if (auto *shared = expr.getIf<SharedExpr>())
+    return shared->expr.get();
+  return std::nullopt;
+}
+
+ast::ExprPtr ast::Interner::intern(ExprPtr expr) {
+  auto *binary = expr->getIf<BinaryExpr>();
+  if (!binary)
+    return expr;
+
+  auto left = operand(*binary->left), right = operand(*binary->right);
+  if (!left || !right)
+    return expr;
+
+  auto [entry, inserted] =
+      table.try_emplace(Key{binary->op, std::move(*left), std::move(*right)});
+  if (inserted)
+    entry->second = std::move(expr);
+  else
+    ++hits;
+  return make<SharedExpr>(entry->second);
+}
@@ -2,107 +2,161 @@
 #include "ast/ast.hpp"
 #include "lexer.hpp"
 #include "logger.hpp"
+#include <bit>
+#include <cmath>
+#include <map>
 #include <memory>
 #include <print>
-#include <sstream>
+#include <variant>
 
-static void tracePrintTokens(std::deque<Token> &tokens) {
-  std::stringstream ss;
-  for (int i = 0; i < 5 && i < tokens.size(); ++i)
-    ss << std::format("{} ", tokens[i]);
-  TRACE(ss.str());
+namespace parser {
+
+static void tracePrintTokens(TokenStream &tokens) {
+  if (!log::enabled(log::trace))
+    return;
+  log::Record record(log::trace);
+  for (size_t i = 0; i < 5 && tokens.peek(i).kind != TokenKind::EndOfInput; ++i)
+    record << std::format("{} ", tokens.peek(i));
 }
 
-namespace parser {
+Token &TokenStream::peek(size_t n) {
+  return fill(n + 1) ? buffered[n] : endOfInput;
+}
 
-static std::unique_ptr<ast::Expr> parseExpr(std::deque<Token> &tokens);
+void TokenStream::pop_front() {
+  if (fill(1))
+    buffered.pop_front();
+}
+
+bool TokenStream::fill(size_t n) {
+  while (buffered.size() < n && source) {
+    if (!source(buffered))
+      source = nullptr;
+  }
+  return buffered.size() >= n;
+}
+
+static std::unique_ptr<ast::Expr> parseExpr(TokenStream &tokens);
 static std::unique_ptr<ast::Expr>
-parseIdentifierExpr(std::deque<Token> &tokens);
-static std::unique_ptr<ast::Expr> parseNumberExpr(std::deque<Token> &tokens);
-static std::unique_ptr<ast::Expr> parseParenExpr(std::deque<Token> &tokens);
-static std::unique_ptr<ast::IfExpr> parseIfExpr(std::deque<Token> &tokens);
-static std::unique_ptr<ast::ForExpr> parseForExpr(std::deque<Token> &tokens);
+parseIdentifierExpr(TokenStream &tokens);
+static std::unique_ptr<ast::Expr> parseNumberExpr(TokenStream &tokens);
+static std::unique_ptr<ast::Expr> parseIfExpr(TokenStream &tokens);
+static std::unique_ptr<ast::Expr> parseForExpr(TokenStream &tokens);
+static bool parseLoopHints(TokenStream &tokens, ast::LoopHints &hints);
 static std::unique_ptr<ast::FunctionDefinition>
-parseFunctionDefinition(std::deque<Token> &tokens);
+parseFunctionDefinition(TokenStream &tokens);
 static std::unique_ptr<ast::FunctionDefinition>
-parseTopLevelExpr(std::deque<Token> &tokens);
+parseTopLevelExpr(TokenStream &tokens);
 static std::unique_ptr<ast::FunctionPrototype>
-parseExtern(std::deque<Token> &tokens);
+parseExtern(TokenStream &tokens);
 std::optional<ast::OperatorKind> tokenToBinaryOperator(Token token);
 
 std::unique_ptr<ast::CompilationUnit> parse(std::deque<Token> &tokens,
-                                            std::string filename) {
+                                            std::string filename,
+                                            bool hashCons) {
   auto functions = std::vector<std::unique_ptr<ast::FunctionDefinition>>();
+  auto externs = std::vector<std::unique_ptr<ast::FunctionPrototype>>();
+
+  TokenStream stream(std::move(tokens));
+  ast::Interner interner;
+  if (hashCons)
+    stream.interner = &interner;
+  while (!stream.empty()) {
+    auto node = parseTopLevel(stream);
+    if (!node)
+      return nullptr;
+    if (auto *fn =
+            std::get_if<std::unique_ptr<ast::FunctionDefinition>>(&*node))
+      functions.push_back(std::move(*fn));
+    else
+      externs.push_back(
+          std::move(std::get<std::unique_ptr<ast::FunctionPrototype>>(*node)));
+  }
+  if (hashCons)
+    DEBUG("Hash-consed" << log::kv("distinct", interner.distinct())
+                        << log::kv("reused", interner.reused()));
+  return std::make_unique<ast::CompilationUnit>(ast::CompilationUnit(
+      filename, std::move(functions), std::move(externs)));
+}
 
-  // TODO: handle extern here
-  std::unique_ptr<ast::FunctionDefinition> node;
-  while (tokens.size() > 0) {
-    auto token = tokens.front();
-    switch (token.getKind()) {
-    case TokenKind::Def:
-      node = parseFunctionDefinition(tokens);
-      if (!node)
-        return nullptr;
-      functions.push_back(std::move(node));
-      break;
-    default:
-      node = parseTopLevelExpr(tokens);
-      if (!node)
-        return nullptr;
-      functions.push_back(std::move(node));
-    }
+std::unique_ptr<ast::CompilationUnit> parseBuffer(const llvm::MemoryBuffer *buf,
+                                                  std::string filename,
+                                                  bool hashCons) {
+  // Lexer
+  DEBUG("*** Source ***\n" << buf->getBuffer());
+  auto lexer_result = tokenize(buf);
+  if (std::holds_alternative<std::string>(lexer_result)) {
+    ERROR("Lexer error: " << std::get<std::string>(lexer_result));
+    return nullptr;
+  }
+  auto tokens = std::get<std::deque<Token>>(lexer_result);
+  DEBUG("*** Tokens ***");
+
+  if (log::enabled(log::debug)) {
+    log::Record tokensLog(log::debug);
+    for (Token &token : tokens)
+      tokensLog << std::format("{} ", token);
+  }
+
+  // Parser
+  return parse(tokens, std::move(filename), hashCons);
+}
+
+std::optional<TopLevel> parseTopLevel(TokenStream &tokens) {
+  switch (tokens.front().getKind()) {
+  case TokenKind::Def:
+    if (auto fn = parseFunctionDefinition(tokens))
+      return fn;
+    return std::nullopt;
+  case TokenKind::Extern:
+    if (auto proto = parseExtern(tokens))
+      return proto;
+    return std::nullopt;
+  default:
+    if (auto fn = parseTopLevelExpr(tokens))
+      return fn;
+    return std::nullopt;
   }
-  return std::make_unique<ast::CompilationUnit>(
-      ast::CompilationUnit(filename, std::move(functions)));
 }
 
-static std::unique_ptr<ast::Expr> parsePrimary(std::deque<Token> &tokens) {
+// Parentheses are handled by parseExpr
+static std::unique_ptr<ast::Expr> parsePrimary(TokenStream &tokens) {
   auto token = tokens.front();
+  std::unique_ptr<ast::Expr> expr;
   switch (token.getKind()) {
   case TokenKind::Identifier:
-    return parseIdentifierExpr(tokens);
+    expr = parseIdentifierExpr(tokens);
+    break;
   case TokenKind::Number:
-    return parseNumberExpr(tokens);
-  case TokenKind::ParenOpen:
-    return parseParenExpr(tokens);
+    expr = parseNumberExpr(tokens);
+    break;
   case TokenKind::If:
-    return parseIfExpr(tokens);
+    expr = parseIfExpr(tokens);
+    break;
   case TokenKind::For:
-    return parseForExpr(tokens);
+    expr = parseForExpr(tokens);
+    break;
   default:
     ERROR(std::format("Unknown token when parsing a primary expression {}",
                       token));
     tracePrintTokens(tokens);
     return nullptr;
   }
+  if (expr)
+    expr->loc = token.loc;
+  return expr;
 }
 
-static std::unique_ptr<ast::Expr> parseNumberExpr(std::deque<Token> &tokens) {
+static std::unique_ptr<ast::Expr> parseNumberExpr(TokenStream &tokens) {
   auto token = tokens.front();
   tokens.pop_front();
   auto data = std::get<double>(*token.getData());
-  auto result = std::make_unique<ast::NumberExpr>(data);
+  auto result = ast::make<ast::NumberExpr>(data);
   return std::move(result);
 }
 
-static std::unique_ptr<ast::Expr> parseParenExpr(std::deque<Token> &tokens) {
-  TRACE("Parsing paren expr");
-  tokens.pop_front();
-  auto val = parseExpr(tokens);
-  if (!val)
-    return nullptr;
-
-  auto token = tokens.front();
-  if (token.getKind() != TokenKind::ParenClose) {
-    ERROR("Expected ')'");
-    return nullptr;
-  }
-  tokens.pop_front();
-  return std::move(val);
-}
-
 static std::unique_ptr<ast::Expr>
-parseIdentifierExpr(std::deque<Token> &tokens) {
+parseIdentifierExpr(TokenStream &tokens) {
   auto token = tokens.front();
   std::string idName = std::get<std::string>(*token.getData());
   tokens.pop_front();
@@ -110,7 +164,7 @@ parseIdentifierExpr(std::deque<Token> &tokens) {
   token = tokens.front();
   // Variable reference
   if (token.getKind() != TokenKind::ParenOpen)
-    return std::make_unique<ast::VariableExpr>(idName);
+    return ast::make<ast::VariableExpr>(idName);
 
   // Function call
   tokens.pop_front();
@@ -143,53 +197,113 @@ parseIdentifierExpr(std::deque<Token> &tokens) {
   // Pop the ')'
   tokens.pop_front();
 
-  return std::make_unique<ast::CallExpr>(idName, std::move(args));
+  return ast::make<ast::CallExpr>(idName, std::move(args));
 }
 
-static std::unique_ptr<ast::Expr>
-parseBinOpRhs(std::deque<Token> &tokens, int precedence,
-              std::unique_ptr<ast::Expr> lhs) {
-  while (true) {
-    auto token = tokens.front();
-    int newPrecedence = token.precedence();
-    if (newPrecedence < precedence)
-      return lhs;
+// Shunting-yard over binary operators and parentheses. Operands and pending
+// operators live on explicit stacks, so long operator chains and deeply
+// nested parentheses do not grow the call stack
+static std::unique_ptr<ast::Expr> parseOperators(TokenStream &tokens) {
 
-    auto op = tokens.front();
-    tokens.pop_front();
-    auto rhs = parsePrimary(tokens);
-    if (!rhs)
-      return nullptr;
-
-    token = tokens.front();
-    if (newPrecedence < token.precedence()) {
-      rhs = parseBinOpRhs(tokens, newPrecedence + 1, std::move(rhs));
-      if (!rhs)
-        return nullptr;
-    }
+  std::vector<std::unique_ptr<ast::Expr>> operands;
+  // Operators waiting for their right operand; '(' marks an open group
+  std::vector<Token> operators;
+  size_t openParens = 0;
 
+  // Merge the top two operands with the top operator
+  auto reduce = [&]() -> bool {
+    auto op = operators.back();
+    operators.pop_back();
     auto binop = tokenToBinaryOperator(op);
     if (!binop.has_value()) {
-      ERROR(std::format("Invalid binary operator {}", token));
+      ERROR(std::format("Invalid binary operator {}", op));
+      return false;
+    }
+
+    auto rhs = std::move(operands.back());
+    operands.pop_back();
+    auto lhs = std::move(operands.back());
+    operands.pop_back();
+    auto merged = ast::make<ast::BinaryExpr>(binop.value(), std::move(lhs),
+                                             std::move(rhs));
+    merged->loc = op.loc;
+    if (tokens.interner) {
+      merged = tokens.interner->intern(std::move(merged));
+      merged->loc = op.loc;
+    }
+    operands.push_back(std::move(merged));
+    return true;
+  };
+
+  while (true) {
+    while (tokens.front().getKind() == TokenKind::ParenOpen) {
+      operators.push_back(tokens.front());
+      tokens.pop_front();
+      ++openParens;
+    }
+
+    auto operand = parsePrimary(tokens);
+    if (!operand)
       return nullptr;
+    operands.push_back(std::move(operand));
+
+    // A ')' we did not open ends an enclosing call's argument
+    while (openParens > 0 &&
+           tokens.front().getKind() == TokenKind::ParenClose) {
+      while (operators.back().getKind() != TokenKind::ParenOpen)
+        if (!reduce())
+          return nullptr;
+      operators.pop_back();
+      tokens.pop_front();
+      --openParens;
     }
-    // merge lhs & rhs
-    lhs = std::make_unique<ast::BinaryExpr>(binop.value(), std::move(lhs),
-                                            std::move(rhs));
+
+    int precedence = tokens.front().precedence();
+    if (precedence < 0)
+      break;
+
+    // Operators of equal precedence associate to the left
+    while (!operators.empty() &&
+           operators.back().getKind() != TokenKind::ParenOpen &&
+           operators.back().precedence() >= precedence)
+      if (!reduce())
+        return nullptr;
+    operators.push_back(tokens.front());
+    tokens.pop_front();
+  }
+
+  if (openParens > 0) {
+    ERROR("Expected ')'");
+    return nullptr;
   }
+  while (!operators.empty())
+    if (!reduce())
+      return nullptr;
+  return std::move(operands.back());
 }
 
-static std::unique_ptr<ast::Expr> parseExpr(std::deque<Token> &tokens) {
+// Only if, for and call arguments nest expressions through the call stack,
+// here and again in codegen. Every AST is built by this parser, so limiting
+// the nesting here keeps both within a fixed stack budget
+constexpr unsigned MaxNesting = 256;
+
+static std::unique_ptr<ast::Expr> parseExpr(TokenStream &tokens) {
   TRACE("Parsing Expr");
   tracePrintTokens(tokens);
-  auto lhs = parsePrimary(tokens);
-  if (!lhs)
-    return nullptr;
 
-  return parseBinOpRhs(tokens, 0, std::move(lhs));
+  if (tokens.depth == MaxNesting) {
+    ERROR(std::format("Expressions nest deeper than {} levels of if, for and "
+                      "call arguments",
+                      MaxNesting));
+    return nullptr;
+  }
+  ++tokens.depth;
+  auto expr = parseOperators(tokens);
+  --tokens.depth;
+  return expr;
 }
 
-static std::unique_ptr<ast::IfExpr> parseIfExpr(std::deque<Token> &tokens) {
+static std::unique_ptr<ast::Expr> parseIfExpr(TokenStream &tokens) {
   TRACE("Parsing IfExpr");
   tracePrintTokens(tokens);
 
@@ -225,11 +339,11 @@ static std::unique_ptr<ast::IfExpr> parseIfExpr(std::deque<Token> &tokens) {
   if (tokens.front().getKind() == TokenKind::Semicolon)
     tokens.pop_front();
 
-  return std::make_unique<ast::IfExpr>(std::move(Cond), std::move(Then),
-                                       std::move(Else));
+  return ast::make<ast::IfExpr>(std::move(Cond), std::move(Then),
+                                std::move(Else));
 }
 
-static std::unique_ptr<ast::ForExpr> parseForExpr(std::deque<Token> &tokens) {
+static std::unique_ptr<ast::Expr> parseForExpr(TokenStream &tokens) {
   tokens.pop_front();
   if (tokens.front().getKind() != TokenKind::Identifier) {
     ERROR("Expected identifier after for");
@@ -268,6 +382,10 @@ static std::unique_ptr<ast::ForExpr> parseForExpr(std::deque<Token> &tokens) {
       return nullptr;
   }
 
+  ast::LoopHints hints;
+  if (!parseLoopHints(tokens, hints))
+    return nullptr;
+
   if (tokens.front().getKind() != TokenKind::In) {
     ERROR("Expected 'in' after for");
     return nullptr;
@@ -281,13 +399,151 @@ static std::unique_ptr<ast::ForExpr> parseForExpr(std::deque<Token> &tokens) {
   if (tokens.front().getKind() == TokenKind::Semicolon)
     tokens.pop_front();
 
-  return std::make_unique<ast::ForExpr>(idName, std::move(start),
-                                        std::move(end), std::move(step),
-                                        std::move(body));
+  auto loop = ast::make<ast::ForExpr>(idName, std::move(start), std::move(end),
+                                      std::move(step), std::move(body));
+  loop->getIf<ast::ForExpr>()->hints = hints;
+  return loop;
+}
+
+// Largest count an annotation such as @unroll(n) takes
+constexpr double MaxHintCount = 65536;
+
+struct Annotation {
+  std::string name;
+  unsigned count = 0; // 0 when written without one
+};
+
+// Any number of `@name` or `@name(count)` annotations; std::nullopt on error
+static std::optional<std::vector<Annotation>>
+parseAnnotations(TokenStream &tokens) {
+  std::vector<Annotation> annotations;
+  while (tokens.front().getKind() == TokenKind::At) {
+    tokens.pop_front();
+    auto token = tokens.front();
+    if (token.getKind() != TokenKind::Identifier) {
+      ERROR("Expected an annotation name after '@'");
+      return std::nullopt;
+    }
+    Annotation annotation{std::get<std::string>(*token.getData())};
+    tokens.pop_front();
+
+    if (tokens.front().getKind() == TokenKind::ParenOpen) {
+      tokens.pop_front();
+      token = tokens.front();
+      double count = token.getKind() == TokenKind::Number
+                         ? std::get<double>(*token.getData())
+                         : 0;
+      if (count < 1 || count > MaxHintCount || count != std::trunc(count)) {
+        ERROR(std::format("Expected a whole count from 1 to {} in @{}",
+                          MaxHintCount, annotation.name));
+        return std::nullopt;
+      }
+      tokens.pop_front();
+      if (tokens.front().getKind() != TokenKind::ParenClose) {
+        ERROR(std::format("Expected ')' after the count of @{}",
+                          annotation.name));
+        return std::nullopt;
+      }
+      tokens.pop_front();
+      annotation.count = static_cast<unsigned>(count);
+    }
+    annotations.push_back(std::move(annotation));
+  }
+  return annotations;
+}
+
+// @unroll(n), @nounroll and @vectorize(width), written before the `in`
+static bool parseLoopHints(TokenStream &tokens, ast::LoopHints &hints) {
+  auto annotations = parseAnnotations(tokens);
+  if (!annotations)
+    return false;
+  for (auto &[name, count] : *annotations) {
+    if (name == "unroll" || name == "vectorize") {
+      if (!count) {
+        ERROR(std::format("@{0} needs a count, e.g. @{0}(4)", name));
+        return false;
+      }
+      if (name == "vectorize" && !std::has_single_bit(count)) {
+        ERROR("The width of @vectorize must be a power of two");
+        return false;
+      }
+      (name == "unroll" ? hints.unroll : hints.vectorize) = count;
+    } else if (name == "nounroll") {
+      if (count) {
+        ERROR("@nounroll takes no count");
+        return false;
+      }
+      hints.noUnroll = true;
+    } else {
+      ERROR(std::format("Unknown loop annotation @{}", name));
+      return false;
+    }
+  }
+  if (hints.unroll && hints.noUnroll) {
+    ERROR("@unroll and @nounroll exclude each other");
+    return false;
+  }
+  return true;
+}
+
+// @inline, @noinline, @hot, @cold and @pure, written after the prototype
+static bool parseFunctionHints(TokenStream &tokens, ast::FunctionHints &hints) {
+  static const std::map<std::string, bool ast::FunctionHints::*> flags = {
+      {"inline", &ast::FunctionHints::alwaysInline},
+      {"noinline", &ast::FunctionHints::noInline},
+      {"hot", &ast::FunctionHints::hot},
+      {"cold", &ast::FunctionHints::cold},
+      {"pure", &ast::FunctionHints::pure},
+  };
+  auto annotations = parseAnnotations(tokens);
+  if (!annotations)
+    return false;
+  for (auto &[name, count] : *annotations) {
+    auto flag = flags.find(name);
+    if (flag == flags.end()) {
+      ERROR(std::format("Unknown function annotation @{}", name));
+      return false;
+    }
+    if (count) {
+      ERROR(std::format("@{} takes no count", name));
+      return false;
+    }
+    hints.*flag->second = true;
+  }
+  if (hints.alwaysInline && hints.noInline) {
+    ERROR("@inline and @noinline exclude each other");
+    return false;
+  }
+  if (hints.hot && hints.cold) {
+    ERROR("@hot and @cold exclude each other");
+    return false;
+  }
+  return true;
+}
+
+// Optional `: type` annotation, where type is double, vec2, vec4 or vec8;
+// the lanes of the type (1 without annotation), 0 on error
+static unsigned parseTypeAnnotation(TokenStream &tokens) {
+  if (tokens.front().getKind() != TokenKind::Colon)
+    return 1;
+  tokens.pop_front();
+
+  auto token = tokens.front();
+  if (token.getKind() == TokenKind::Identifier) {
+    const auto &name = std::get<std::string>(*token.getData());
+    for (unsigned lanes : {1, 2, 4, 8}) {
+      if (name == ast::typeName(lanes)) {
+        tokens.pop_front();
+        return lanes;
+      }
+    }
+  }
+  ERROR("Expected double, vec2, vec4 or vec8 after ':'");
+  return 0;
 }
 
 static std::unique_ptr<ast::FunctionPrototype>
-parseFunctionPrototype(std::deque<Token> &tokens) {
+parseFunctionPrototype(TokenStream &tokens) {
   TRACE("Parsing FunctionPrototype");
   tracePrintTokens(tokens);
   auto token = tokens.front();
@@ -297,6 +553,7 @@ parseFunctionPrototype(std::deque<Token> &tokens) {
   }
 
   std::string functionName = std::get<std::string>(*token.getData());
+  SourceLocation loc = token.loc;
   tokens.pop_front();
   token = tokens.front();
 
@@ -308,9 +565,13 @@ parseFunctionPrototype(std::deque<Token> &tokens) {
   tokens.pop_front();
   token = tokens.front();
   std::vector<std::string> argNames;
+  std::vector<unsigned> argLanes;
   while (token.getKind() == TokenKind::Identifier) {
     argNames.push_back(std::get<std::string>(*token.getData()));
     tokens.pop_front();
+    argLanes.push_back(parseTypeAnnotation(tokens));
+    if (!argLanes.back())
+      return nullptr;
     if (tokens.front().getKind() == TokenKind::Comma) {
       tokens.pop_front();
     }
@@ -323,15 +584,24 @@ parseFunctionPrototype(std::deque<Token> &tokens) {
   }
 
   tokens.pop_front();
+  unsigned lanes = parseTypeAnnotation(tokens);
+  if (!lanes)
+    return nullptr;
+  ast::FunctionHints hints;
+  if (!parseFunctionHints(tokens, hints))
+    return nullptr;
 
   TRACE(std::format("Got {} args for {}", argNames.size(), functionName));
 
-  return std::make_unique<ast::FunctionPrototype>(functionName,
-                                                  std::move(argNames));
+  auto proto = std::make_unique<ast::FunctionPrototype>(
+      functionName, std::move(argNames), std::move(argLanes), lanes);
+  proto->hints = hints;
+  proto->loc = loc;
+  return proto;
 }
 
 static std::unique_ptr<ast::FunctionDefinition>
-parseFunctionDefinition(std::deque<Token> &tokens) {
+parseFunctionDefinition(TokenStream &tokens) {
   TRACE("Parsing FunctionDefinition");
   tracePrintTokens(tokens);
   // Consume 'def'
@@ -348,18 +618,25 @@ parseFunctionDefinition(std::deque<Token> &tokens) {
 }
 
 static std::unique_ptr<ast::FunctionPrototype>
-parseExtern(std::deque<Token> &tokens) {
+parseExtern(TokenStream &tokens) {
+  TRACE("Parsing Extern");
+  // Consume 'extern'
   tokens.pop_front();
-  return parseFunctionPrototype(tokens);
+  auto proto = parseFunctionPrototype(tokens);
+  if (proto && tokens.front().getKind() == TokenKind::Semicolon)
+    tokens.pop_front();
+  return proto;
 }
 
 // TODO: this needs its own algebraic type
 static std::unique_ptr<ast::FunctionDefinition>
-parseTopLevelExpr(std::deque<Token> &tokens) {
+parseTopLevelExpr(TokenStream &tokens) {
+  SourceLocation loc = tokens.front().loc;
   if (auto expr = parseExpr(tokens)) {
     // anonymous prototype
     auto proto = std::make_unique<ast::FunctionPrototype>(
         "", std::vector<std::string>());
+    proto->loc = loc;
     return std::make_unique<ast::FunctionDefinition>(std::move(proto),
                                                      std::move(expr));
   }
@@ -1,84 +1,539 @@
 #include "ast/printer.hpp"
 #include "ast/ast.hpp"
-#include <sstream>
-
-std::string ast::BinaryExpr::tree_format(uint32_t indent_level) {
-  std::string indent = "";
-  for (int i = 0; i < indent_level; ++i)
-    indent += INDENT;
-  std::stringstream result;
-  result << indent << "BinaryExpr" << '\n';
-  indent += INDENT;
-
-  result << indent << std::format("Op: {}\n", op);
-  result << indent
-         << std::format("Left:\n{}", left->tree_format(indent_level + 2));
-  result << indent
-         << std::format("Right:\n{}", right->tree_format(indent_level + 2));
-  return result.str();
+#include "ast/visitor.hpp"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <optional>
+#include <vector>
+
+namespace {
+
+// Indentation is counted in two-space steps
+void indent(llvm::raw_ostream &os, unsigned level) { os.indent(2 * level); }
+
+// Each annotation preceded by a space
+void writeAnnotations(llvm::raw_ostream &os,
+                      const std::vector<std::string> &annotations) {
+  for (auto &annotation : annotations)
+    os << ' ' << annotation;
 }
 
-std::string ast::CallExpr::tree_format(uint32_t indent_level) {
-  std::string indent = "";
-  for (int i = 0; i < indent_level; ++i)
-    indent += INDENT;
-  std::stringstream result;
-  result << indent << "CallExpr" << '\n';
-  indent += INDENT;
-  result << indent << "Callee: " << this->callee << '\n';
-  result << indent << "Args: " << '\n';
-  for (auto &arg : this->args)
-    result << arg->tree_format(indent_level + 2);
-  return result.str();
+// A "hints" array, left out when there are none so plain dumps stay as they
+// were
+void jsonAnnotations(llvm::json::OStream &json,
+                     const std::vector<std::string> &annotations) {
+  if (annotations.empty())
+    return;
+  json.attributeArray("hints", [&] {
+    for (auto &annotation : annotations)
+      json.value(annotation);
+  });
 }
 
-std::string ast::NumberExpr::tree_format(uint32_t indent_level) {
-  std::string indent = "";
-  for (int i = 0; i < indent_level; ++i)
-    indent += INDENT;
-  return std::format("{}NumberExpr: {}\n", indent, this->val);
+// Shortest round-trip representation, same as std::format("{}")
+void writeNumber(llvm::raw_ostream &os, double val) {
+  char buf[32];
+  auto result = std::to_chars(buf, buf + sizeof(buf), val);
+  os.write(buf, result.ptr - buf);
 }
 
-std::string ast::VariableExpr::tree_format(uint32_t indent_level) {
-  std::string indent = "";
-  for (int i = 0; i < indent_level; ++i)
-    indent += INDENT;
-  return std::format("{}VariableExpr: {}\n", indent, this->name);
+// Child slot `i` of `expr`, in print order: a for loop without a step has
+// an empty slot there, and std::nullopt marks the end. A SharedExpr has its
+// subtree as its only slot, as shared subtrees print wherever they occur.
+std::optional<const ast::Expr *> childSlot(const ast::Expr &expr, unsigned i) {
+  using Slot = std::optional<const ast::Expr *>;
+  return ast::visit(
+      ast::overloaded{
+          [&](const ast::BinaryExpr &node) -> Slot {
+            const ast::Expr *slots[] = {node.left.get(), node.right.get()};
+            return i < 2 ? Slot(slots[i]) : std::nullopt;
+          },
+          [&](const ast::CallExpr &node) -> Slot {
+            return i < node.args.size() ? Slot(node.args[i].get())
+                                        : std::nullopt;
+          },
+          [&](const ast::IfExpr &node) -> Slot {
+            const ast::Expr *slots[] = {node.Cond.get(), node.Then.get(),
+                                        node.Else.get()};
+            return i < 3 ? Slot(slots[i]) : std::nullopt;
+          },
+          [&](const ast::ForExpr &node) -> Slot {
+            const ast::Expr *slots[] = {node.Start.get(), node.End.get(),
+                                        node.Step.get(), node.Body.get()};
+            return i < 4 ? Slot(slots[i]) : std::nullopt;
+          },
+          [&](const ast::SharedExpr &node) -> Slot {
+            return i == 0 ? Slot(node.expr.get()) : std::nullopt;
+          },
+          [](const auto &) -> Slot { return std::nullopt; },
+      },
+      expr);
 }
 
-std::string ast::IfExpr::tree_format(uint32_t indent_level) {
-  std::string indent = "";
-  for (int i = 0; i < indent_level; ++i)
-    indent += INDENT;
-  std::stringstream result;
-  result << indent << "IfExpr:" << '\n';
-  indent += INDENT;
-  result << indent << "Cond:" << '\n'
-         << this->Cond->tree_format(indent_level + 2);
-  result << indent << "Then:" << '\n'
-         << this->Then->tree_format(indent_level + 2);
-  result << indent << "Else:" << '\n'
-         << this->Else->tree_format(indent_level + 2);
-  return result.str();
+// Name of child slot `i`: the JSON key, capitalised as the tree label.
+// Call arguments and shared subtrees have none.
+const char *slotName(const ast::Expr &expr, unsigned i) {
+  return ast::visit(
+      ast::overloaded{
+          [&](const ast::BinaryExpr &) -> const char * {
+            return i == 0 ? "left" : "right";
+          },
+          [&](const ast::IfExpr &) -> const char * {
+            const char *names[] = {"cond", "then", "else"};
+            return names[i];
+          },
+          [&](const ast::ForExpr &) -> const char * {
+            const char *names[] = {"start", "end", "step", "body"};
+            return names[i];
+          },
+          [](const auto &) -> const char * { return nullptr; },
+      },
+      expr);
 }
 
-std::string ast::ForExpr::tree_format(uint32_t indent_level) {
-  std::string indent = "";
-  for (int i = 0; i < indent_level; ++i)
-    indent += INDENT;
-  std::stringstream result;
-
-  result << indent << "ForExpr:" << '\n';
-  indent += INDENT;
-  result << indent << "VarName: " << this->VarName << '\n';
-  result << indent << "Start:" << '\n'
-         << this->Start->tree_format(indent_level + 2);
-  result << indent << "End:" << '\n'
-         << this->End->tree_format(indent_level + 2);
-  result << indent << "Step:" << '\n'
-         << this->Step->tree_format(indent_level + 2);
-  result << indent << "Body:" << '\n'
-         << this->Body->tree_format(indent_level + 2);
-
-  return result.str();
+// The printers never call themselves. walk() keeps one frame per open node
+// on an explicit stack and calls the printer's hooks as it goes: enter() on
+// the way down, child() and childDone() around each child slot, and leave()
+// once the slots run out. Printing depth is limited by memory only, and a
+// node costs one frame, not an allocation.
+template <typename Printer>
+void walk(Printer &printer, const ast::Expr &root, unsigned level) {
+  struct Frame {
+    const ast::Expr *expr;
+    // The slot to print next
+    unsigned next;
+    unsigned level;
+  };
+  std::vector<Frame> work = {{&root, 0, level}};
+
+  while (!work.empty()) {
+    auto [expr, next, at] = work.back();
+    if (next == 0)
+      printer.enter(*expr, at);
+    else
+      printer.childDone(*expr, next - 1, *childSlot(*expr, next - 1));
+
+    auto slot = childSlot(*expr, next);
+    if (!slot) {
+      printer.leave(*expr);
+      work.pop_back();
+      continue;
+    }
+    ++work.back().next;
+    unsigned childLevel = printer.child(*expr, next, *slot, at);
+    if (*slot)
+      work.push_back({*slot, 0, childLevel});
+  }
+}
+
+struct TreePrinter {
+  llvm::raw_ostream &os;
+
+  void enter(const ast::Expr &expr, unsigned level) {
+    ast::visit(
+        ast::overloaded{
+            [&](const ast::NumberExpr &node) {
+              indent(os, level);
+              os << "NumberExpr: ";
+              writeNumber(os, node.val);
+              os << '\n';
+            },
+            [&](const ast::VariableExpr &node) {
+              indent(os, level);
+              os << "VariableExpr: " << node.name << '\n';
+            },
+            [&](const ast::BinaryExpr &node) {
+              indent(os, level);
+              os << "BinaryExpr\n";
+              indent(os, level + 1);
+              os << "Op: " << ast::operatorSymbol(node.op) << '\n';
+            },
+            [&](const ast::CallExpr &node) {
+              indent(os, level);
+              os << "CallExpr\n";
+              indent(os, level + 1);
+              os << "Callee: " << node.callee << '\n';
+              indent(os, level + 1);
+              os << "Args: \n";
+            },
+            [&](const ast::IfExpr &) {
+              indent(os, level);
+              os << "IfExpr:\n";
+            },
+            [&](const ast::ForExpr &node) {
+              indent(os, level);
+              os << "ForExpr:\n";
+              indent(os, level + 1);
+              os << "VarName: " << node.VarName << '\n';
+              if (auto hints = ast::annotations(node.hints); !hints.empty()) {
+                indent(os, level + 1);
+                os << "Hints:";
+                writeAnnotations(os, hints);
+                os << '\n';
+              }
+            },
+            [](const ast::SharedExpr &) {},
+        },
+        expr);
+  }
+
+  unsigned child(const ast::Expr &parent, unsigned i, const ast::Expr *slot,
+                 unsigned level) {
+    if (parent.getIf<ast::SharedExpr>())
+      return level;
+    if (const char *name = slotName(parent, i); name && slot) {
+      indent(os, level + 1);
+      os << char(std::toupper(name[0])) << name + 1 << ":\n";
+    }
+    return level + 2;
+  }
+
+  void childDone(const ast::Expr &, unsigned, const ast::Expr *) {}
+  void leave(const ast::Expr &) {}
+};
+
+struct SExprPrinter {
+  llvm::raw_ostream &os;
+
+  void enter(const ast::Expr &expr, unsigned) {
+    ast::visit(
+        ast::overloaded{
+            [&](const ast::NumberExpr &node) { writeNumber(os, node.val); },
+            [&](const ast::VariableExpr &node) { os << node.name; },
+            [&](const ast::BinaryExpr &node) {
+              os << '(' << ast::operatorSymbol(node.op);
+            },
+            [&](const ast::CallExpr &node) { os << "(call " << node.callee; },
+            [&](const ast::IfExpr &) { os << "(if"; },
+            [&](const ast::ForExpr &node) {
+              os << "(for " << node.VarName;
+              writeAnnotations(os, ast::annotations(node.hints));
+            },
+            [](const ast::SharedExpr &) {},
+        },
+        expr);
+  }
+
+  unsigned child(const ast::Expr &parent, unsigned, const ast::Expr *slot,
+                 unsigned level) {
+    if (!parent.getIf<ast::SharedExpr>())
+      os << (slot ? " " : " nil");
+    return level;
+  }
+
+  void childDone(const ast::Expr &, unsigned, const ast::Expr *) {}
+
+  void leave(const ast::Expr &expr) {
+    if (!expr.getIf<ast::NumberExpr>() && !expr.getIf<ast::VariableExpr>() &&
+        !expr.getIf<ast::SharedExpr>())
+      os << ')';
+  }
+};
+
+struct JsonPrinter {
+  llvm::json::OStream &json;
+
+  void enter(const ast::Expr &expr, unsigned) {
+    ast::visit(
+        ast::overloaded{
+            [&](const ast::NumberExpr &node) {
+              json.object([&] {
+                json.attribute("kind", "number");
+                // JSON has no literal for infinities or NaN, which folding
+                // can produce
+                if (std::isnan(node.val))
+                  json.attribute("value", "nan");
+                else if (std::isinf(node.val))
+                  json.attribute("value", node.val > 0 ? "inf" : "-inf");
+                else
+                  json.attribute("value", node.val);
+              });
+            },
+            [&](const ast::VariableExpr &node) {
+              json.object([&] {
+                json.attribute("kind", "variable");
+                json.attribute("name", node.name);
+              });
+            },
+            [&](const ast::BinaryExpr &node) {
+              json.objectBegin();
+              json.attribute("kind", "binary");
+              json.attribute("op", ast::operatorSymbol(node.op));
+            },
+            [&](const ast::CallExpr &node) {
+              json.objectBegin();
+              json.attribute("kind", "call");
+              json.attribute("callee", node.callee);
+              json.attributeBegin("args");
+              json.arrayBegin();
+            },
+            [&](const ast::IfExpr &) {
+              json.objectBegin();
+              json.attribute("kind", "if");
+            },
+            [&](const ast::ForExpr &node) {
+              json.objectBegin();
+              json.attribute("kind", "for");
+              json.attribute("var", node.VarName);
+              jsonAnnotations(json, ast::annotations(node.hints));
+            },
+            [](const ast::SharedExpr &) {},
+        },
+        expr);
+  }
+
+  unsigned child(const ast::Expr &parent, unsigned i, const ast::Expr *slot,
+                 unsigned level) {
+    if (const char *name = slotName(parent, i); name && slot)
+      json.attributeBegin(name);
+    return level;
+  }
+
+  void childDone(const ast::Expr &parent, unsigned i, const ast::Expr *slot) {
+    if (slotName(parent, i) && slot)
+      json.attributeEnd();
+  }
+
+  void leave(const ast::Expr &expr) {
+    if (expr.getIf<ast::CallExpr>()) {
+      json.arrayEnd();
+      json.attributeEnd();
+    }
+    if (!expr.getIf<ast::NumberExpr>() && !expr.getIf<ast::VariableExpr>() &&
+        !expr.getIf<ast::SharedExpr>())
+      json.objectEnd();
+  }
+};
+
+void printJson(llvm::json::OStream &json, const ast::Expr &expr) {
+  JsonPrinter printer{json};
+  walk(printer, expr, 0);
+}
+
+void jsonPrototype(llvm::json::OStream &json,
+                   const ast::FunctionPrototype &proto) {
+  json.attribute("name", proto.getName());
+  json.attributeArray("args", [&] {
+    for (auto &arg : proto.args)
+      json.value(arg);
+  });
+  // Only vector functions carry types, so scalar dumps stay as they were
+  if (proto.usesVectors()) {
+    json.attributeArray("argTypes", [&] {
+      for (unsigned lanes : proto.argLanes)
+        json.value(ast::typeName(lanes));
+    });
+    json.attribute("type", ast::typeName(proto.lanes));
+  }
+  jsonAnnotations(json, ast::annotations(proto.hints));
+}
+
+// Arguments as written, with annotations on the vector ones, then the
+// result annotation and the hints, e.g. "(v:vec4 k):vec4 @inline"
+void printSignature(llvm::raw_ostream &os,
+                    const ast::FunctionPrototype &proto) {
+  os << '(';
+  for (size_t i = 0; i < proto.args.size(); ++i) {
+    os << (i ? " " : "") << proto.args[i];
+    if (proto.argLanes[i] != 1)
+      os << ':' << ast::typeName(proto.argLanes[i]);
+  }
+  os << ')';
+  if (proto.lanes != 1)
+    os << ':' << ast::typeName(proto.lanes);
+  writeAnnotations(os, ast::annotations(proto.hints));
+}
+
+} // namespace
+
+const char *ast::operatorSymbol(OperatorKind op) {
+  switch (op) {
+  case OperatorKind::Plus:
+    return "+";
+  case OperatorKind::Minus:
+    return "-";
+  case OperatorKind::Asterisk:
+    return "*";
+  case OperatorKind::LessThan:
+    return "<";
+  case OperatorKind::GreaterThan:
+    return ">";
+  }
+  return "?";
+}
+
+void ast::print(llvm::raw_ostream &os, const Expr &expr, DumpFormat format,
+                unsigned indent_level) {
+  switch (format) {
+  case DumpFormat::Tree: {
+    TreePrinter printer{os};
+    walk(printer, expr, indent_level);
+    break;
+  }
+  case DumpFormat::SExpr: {
+    SExprPrinter printer{os};
+    walk(printer, expr, 0);
+    break;
+  }
+  case DumpFormat::Json: {
+    llvm::json::OStream json(os);
+    printJson(json, expr);
+    break;
+  }
+  }
+}
+
+void ast::print(llvm::raw_ostream &os, const FunctionPrototype &proto,
+                DumpFormat format, unsigned indent_level) {
+  switch (format) {
+  case DumpFormat::Tree:
+    indent(os, indent_level);
+    os << "Name: " << (proto.getName().empty() ? "[Anonymous]" : proto.name);
+    if (!proto.args.empty()) {
+      os << '\n';
+      indent(os, indent_level);
+      os << "Args: ";
+      for (size_t i = 0; i < proto.args.size(); ++i) {
+        os << proto.args[i];
+        if (proto.argLanes[i] != 1)
+          os << ':' << typeName(proto.argLanes[i]);
+        os << ' ';
+      }
+    }
+    if (proto.lanes != 1) {
+      os << '\n';
+      indent(os, indent_level);
+      os << "Type: " << typeName(proto.lanes);
+    }
+    if (auto hints = annotations(proto.hints); !hints.empty()) {
+      os << '\n';
+      indent(os, indent_level);
+      os << "Hints:";
+      writeAnnotations(os, hints);
+    }
+    break;
+  case DumpFormat::SExpr:
+    os << "(proto " << proto.getName() << ' ';
+    printSignature(os, proto);
+    os << ')';
+    break;
+  case DumpFormat::Json: {
+    llvm::json::OStream json(os);
+    json.object([&] {
+      json.attribute("kind", "proto");
+      jsonPrototype(json, proto);
+    });
+    break;
+  }
+  }
+}
+
+void ast::print(llvm::raw_ostream &os, const FunctionDefinition &fn,
+                DumpFormat format) {
+  switch (format) {
+  case DumpFormat::Tree:
+    os << "FunctionDefinition\n";
+    indent(os, 1);
+    os << "Proto:\n";
+    print(os, *fn.proto, format, 2);
+    os << '\n';
+    indent(os, 1);
+    os << "Body:\n";
+    print(os, *fn.body, format, 2);
+    break;
+  case DumpFormat::SExpr:
+    if (fn.proto->getName().empty()) {
+      os << "(expr ";
+    } else {
+      os << "(def " << fn.proto->getName() << ' ';
+      printSignature(os, *fn.proto);
+      os << ' ';
+    }
+    print(os, *fn.body, format);
+    os << ')';
+    break;
+  case DumpFormat::Json: {
+    llvm::json::OStream json(os);
+    json.object([&] {
+      json.attribute("kind", "def");
+      jsonPrototype(json, *fn.proto);
+      json.attributeBegin("body");
+      printJson(json, *fn.body);
+      json.attributeEnd();
+    });
+    break;
+  }
+  }
+}
+
+void ast::print(llvm::raw_ostream &os, const CompilationUnit &cu,
+                DumpFormat format) {
+  if (format == DumpFormat::Tree)
+    os << "CompilationUnit\n\n";
+
+  for (auto &proto : cu.externs) {
+    switch (format) {
+    case DumpFormat::Tree:
+      os << "Extern\n";
+      print(os, *proto, format, 1);
+      break;
+    case DumpFormat::SExpr:
+      os << "(extern " << proto->getName() << ' ';
+      printSignature(os, *proto);
+      os << ')';
+      break;
+    case DumpFormat::Json: {
+      llvm::json::OStream json(os);
+      json.object([&] {
+        json.attribute("kind", "extern");
+        jsonPrototype(json, *proto);
+      });
+      break;
+    }
+    }
+    os << '\n';
+  }
+
+  // The compact formats put every function on its own line so dumps can be
+  // diffed and processed line by line
+  for (auto &fn : cu.functions) {
+    print(os, *fn, format);
+    os << '\n';
+  }
+}
+
+void ast::printCHeader(llvm::raw_ostream &os, const CompilationUnit &cu,
+                       llvm::StringRef headerPath) {
+  std::string guard;
+  for (char c : llvm::sys::path::stem(headerPath))
+    guard += std::isalnum(c) ? std::toupper(c) : '_';
+  guard += "_H_";
+
+  os << "// Generated from " << cu.name << "\n"
+     << "#ifndef " << guard << "\n#define " << guard << "\n\n"
+     << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+
+  // Parameters stay unnamed: Kaleidoscope names may be C keywords
+  for (auto &fn : cu.functions) {
+    const FunctionPrototype &proto = *fn->proto;
+    // Neither top-level expressions nor specialised clones are exported
+    if (proto.getName().empty() || proto.getName().contains('.'))
+      continue;
+    if (proto.usesVectors()) {
+      os << "// " << proto.getName()
+         << " passes vectors, which have no portable C type\n";
+      continue;
+    }
+    os << "double " << proto.getName() << '(';
+    if (proto.args.empty())
+      os << "void";
+    for (size_t i = 0; i < proto.args.size(); ++i)
+      os << (i ? ", " : "") << "double";
+    os << ");\n";
+  }
+
+  os << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif // " << guard << '\n';
 }
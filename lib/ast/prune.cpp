@@ -0,0 +1,63 @@
+#include "ast/ast.hpp"
+#include "ast/passes.hpp"
+#include "ast/visitor.hpp"
+#include "logger.hpp"
+#include <map>
+#include <unordered_set>
+
+// Only the bodies of reachable functions are walked, so the cost follows the
+// code in use rather than the size of the units
+size_t ast::pruneUnreachable(const std::vector<CompilationUnit *> &units,
+                             const std::vector<std::string> &roots) {
+  // A name defined twice keeps both, for codegen to report
+  std::map<std::string, std::vector<FunctionDefinition *>> definitions;
+  for (CompilationUnit *cu : units)
+    for (auto &fn : cu->functions)
+      if (!fn->proto->getName().empty())
+        definitions[fn->proto->getName()].push_back(fn.get());
+
+  std::unordered_set<const FunctionDefinition *> reachable;
+  std::vector<FunctionDefinition *> work;
+  auto reach = [&](const std::string &name) {
+    auto found = definitions.find(name);
+    if (found == definitions.end())
+      return;
+    for (FunctionDefinition *fn : found->second)
+      if (reachable.insert(fn).second)
+        work.push_back(fn);
+  };
+
+  for (CompilationUnit *cu : units)
+    for (auto &fn : cu->functions)
+      if (fn->proto->getName().empty() && reachable.insert(fn.get()).second)
+        work.push_back(fn.get());
+  for (const std::string &root : roots)
+    reach(root);
+
+  // Shared subtrees are walked once, whichever function reaches them first
+  std::unordered_set<const Expr *> seen;
+  while (!work.empty()) {
+    FunctionDefinition *fn = work.back();
+    work.pop_back();
+    postOrder(
+        *fn->body,
+        [&](Expr &expr) {
+          if (auto *call = expr.getIf<CallExpr>())
+            reach(call->callee);
+        },
+        seen);
+  }
+
+  // Their ASTs are freed here, before any code is generated
+  size_t pruned = 0;
+  for (CompilationUnit *cu : units) {
+    pruned += std::erase_if(cu->functions, [&](const auto &fn) {
+      if (reachable.contains(fn.get()))
+        return false;
+      TRACE("Pruned" << log::kv("function", fn->proto->getName()));
+      return true;
+    });
+  }
+  DEBUG("Pruned unreachable definitions" << log::kv("count", pruned));
+  return pruned;
+}
@@ -0,0 +1,233 @@
+#include "ast/ast.hpp"
+#include "ast/passes.hpp"
+#include "ast/visitor.hpp"
+#include "logger.hpp"
+#include "llvm/Support/ErrorHandling.h"
+#include <algorithm>
+#include <bit>
+#include <deque>
+#include <format>
+#include <map>
+#include <optional>
+#include <unordered_set>
+
+// Bodies larger than this many nodes are never cloned
+constexpr size_t MaxCloneNodes = 512;
+// Clones may add this many nodes, plus half the unit's own size
+constexpr size_t MinGrowthNodes = 1024;
+
+// Bit patterns of the literal arguments of a call, std::nullopt where the
+// argument is not a literal. Bits keep -0.0 and NaNs apart.
+using ArgPattern = std::vector<std::optional<uint64_t>>;
+using Bindings = std::map<std::string, double>;
+
+static size_t countNodes(ast::Expr &root) {
+  size_t nodes = 0;
+  ast::postOrder(root, [&](ast::Expr &) { ++nodes; });
+  return nodes;
+}
+
+// Copy of `root` with the variables in `bindings` replaced by their values.
+// Shared subtrees are copied out, since a variable may be bound differently
+// at each use. Uses an explicit stack, like the other walks.
+static ast::ExprPtr substitute(const ast::Expr &root,
+                               const Bindings &bindings) {
+  struct Frame {
+    const ast::Expr *expr;
+    ast::ExprPtr *slot;
+    const Bindings *bindings;
+  };
+  // Bindings with a loop variable removed, kept alive until the copy is done
+  std::deque<Bindings> shadowed;
+  ast::ExprPtr copy;
+  std::vector<Frame> work = {{&root, &copy, &bindings}};
+
+  while (!work.empty()) {
+    auto [expr, slot, bound] = work.back();
+    work.pop_back();
+    if (auto *shared = expr->getIf<ast::SharedExpr>()) {
+      work.push_back({shared->expr.get(), slot, bound});
+      continue;
+    }
+
+    // Children are filled in when their frames come off the stack
+    size_t first = work.size();
+    auto child = [&](const ast::ExprPtr &from, ast::ExprPtr &to,
+                     const Bindings *in) {
+      work.push_back({from.get(), &to, in});
+    };
+    *slot = ast::visit(
+        ast::overloaded{
+            [](const ast::NumberExpr &node) {
+              return ast::make<ast::NumberExpr>(node.val);
+            },
+            [&](const ast::VariableExpr &node) {
+              auto value = bound->find(node.name);
+              if (value != bound->end())
+                return ast::make<ast::NumberExpr>(value->second);
+              return ast::make<ast::VariableExpr>(node.name);
+            },
+            [&](const ast::BinaryExpr &node) {
+              auto out = ast::make<ast::BinaryExpr>(node.op, nullptr, nullptr);
+              auto &binary = *out->getIf<ast::BinaryExpr>();
+              child(node.left, binary.left, bound);
+              child(node.right, binary.right, bound);
+              return out;
+            },
+            [&](const ast::CallExpr &node) {
+              auto out = ast::make<ast::CallExpr>(
+                  node.callee, std::vector<ast::ExprPtr>(node.args.size()));
+              auto &call = *out->getIf<ast::CallExpr>();
+              for (size_t i = 0; i < node.args.size(); ++i)
+                child(node.args[i], call.args[i], bound);
+              return out;
+            },
+            [&](const ast::IfExpr &node) {
+              auto out = ast::make<ast::IfExpr>(nullptr, nullptr, nullptr);
+              auto &branch = *out->getIf<ast::IfExpr>();
+              child(node.Cond, branch.Cond, bound);
+              child(node.Then, branch.Then, bound);
+              child(node.Else, branch.Else, bound);
+              return out;
+            },
+            [&](const ast::ForExpr &node) {
+              auto out = ast::make<ast::ForExpr>(node.VarName, nullptr, nullptr,
+                                                 nullptr, nullptr);
+              auto &loop = *out->getIf<ast::ForExpr>();
+              loop.hints = node.hints;
+              // The loop variable is in scope everywhere but in Start
+              const Bindings *inner = bound;
+              if (bound->contains(node.VarName)) {
+                inner = &shadowed.emplace_back(*bound);
+                shadowed.back().erase(node.VarName);
+              }
+              child(node.Start, loop.Start, bound);
+              child(node.End, loop.End, inner);
+              if (node.Step)
+                child(node.Step, loop.Step, inner);
+              child(node.Body, loop.Body, inner);
+              return out;
+            },
+            [](const ast::SharedExpr &) -> ast::ExprPtr {
+              llvm_unreachable("shared subtrees are copied out above");
+            },
+        },
+        *expr);
+    (*slot)->loc = expr->loc;
+    // Reversed so that children are copied in source order
+    std::reverse(work.begin() + first, work.end());
+  }
+  return copy;
+}
+
+void ast::specialiseCalls(CompilationUnit &cu, unsigned minCalls) {
+  std::map<std::string, FunctionDefinition *> definitions;
+  size_t unitNodes = 0;
+  for (auto &fn : cu.functions) {
+    if (!fn->proto->getName().empty())
+      definitions[fn->proto->getName()] = fn.get();
+    unitNodes += countNodes(*fn->body);
+  }
+
+  // Calls to functions of this unit with at least one literal argument,
+  // grouped by callee and literals
+  struct Sites {
+    std::vector<CallExpr *> calls;
+    size_t first;
+  };
+  std::map<std::pair<std::string, ArgPattern>, Sites> patterns;
+  std::unordered_set<const Expr *> seen;
+  size_t order = 0;
+  for (auto &fn : cu.functions)
+    postOrder(
+        *fn->body,
+        [&](Expr &expr) {
+          auto *call = expr.getIf<CallExpr>();
+          if (!call)
+            return;
+          auto callee = definitions.find(call->callee);
+          if (callee == definitions.end() ||
+              callee->second->proto->args.size() != call->args.size())
+            return;
+
+          ArgPattern pattern;
+          bool literals = false;
+          for (size_t i = 0; i < call->args.size(); ++i) {
+            // A literal passed for a vector is left for codegen to reject
+            auto *number = callee->second->proto->argLanes[i] == 1
+                               ? call->args[i]->getIf<NumberExpr>()
+                               : nullptr;
+            pattern.push_back(number ? std::optional(std::bit_cast<uint64_t>(
+                                           number->val))
+                                     : std::nullopt);
+            literals |= number != nullptr;
+          }
+          if (!literals)
+            return;
+          auto &sites = patterns[{call->callee, std::move(pattern)}];
+          if (sites.calls.empty())
+            sites.first = order++;
+          sites.calls.push_back(call);
+        },
+        seen);
+
+  // Most frequent patterns first, then in source order
+  std::vector<decltype(patterns)::value_type *> candidates;
+  for (auto &entry : patterns)
+    if (entry.second.calls.size() >= minCalls)
+      candidates.push_back(&entry);
+  std::ranges::sort(candidates, [](auto *a, auto *b) {
+    if (a->second.calls.size() != b->second.calls.size())
+      return a->second.calls.size() > b->second.calls.size();
+    return a->second.first < b->second.first;
+  });
+
+  size_t budget = std::max(MinGrowthNodes, unitNodes / 2);
+  std::map<std::string, unsigned> clones;
+  for (auto *candidate : candidates) {
+    const auto &[callee, pattern] = candidate->first;
+    FunctionDefinition &generic = *definitions[callee];
+    size_t nodes = countNodes(*generic.body);
+    if (nodes > MaxCloneNodes || nodes > budget)
+      continue;
+
+    // The clone keeps the parameters that are not literals
+    Bindings bindings;
+    std::vector<std::string> args;
+    std::vector<unsigned> argLanes;
+    for (size_t i = 0; i < pattern.size(); ++i) {
+      const std::string &arg = generic.proto->args[i];
+      if (pattern[i]) {
+        bindings[arg] = std::bit_cast<double>(*pattern[i]);
+      } else {
+        args.push_back(arg);
+        argLanes.push_back(generic.proto->argLanes[i]);
+      }
+    }
+
+    // Not a valid Kaleidoscope identifier, so it cannot clash with one
+    std::string name = std::format("{}.spec.{}", callee, clones[callee]++);
+    auto proto = std::make_unique<FunctionPrototype>(
+        name, std::move(args), std::move(argLanes), generic.proto->lanes);
+    proto->hints = generic.proto->hints;
+    proto->loc = generic.proto->loc;
+    auto clone = std::make_unique<FunctionDefinition>(
+        std::move(proto), substitute(*generic.body, bindings));
+    foldConstants(*clone);
+    budget -= std::min(budget, countNodes(*clone->body));
+
+    for (CallExpr *call : candidate->second.calls) {
+      call->callee = name;
+      std::vector<ExprPtr> kept;
+      for (size_t i = 0; i < call->args.size(); ++i)
+        if (!pattern[i])
+          kept.push_back(std::move(call->args[i]));
+      call->args = std::move(kept);
+    }
+    DEBUG("Specialised" << log::kv("function", callee)
+                        << log::kv("clone", name)
+                        << log::kv("calls", candidate->second.calls.size()));
+    cu.functions.push_back(std::move(clone));
+  }
+  TRACE("Specialised calls in " << cu.name);
+}
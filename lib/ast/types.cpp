@@ -0,0 +1,174 @@
+#include "ast/types.hpp"
+#include "ast/visitor.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+using ast::ValueType;
+
+// Integers up to 2^53 in magnitude are exact as doubles, so i64 arithmetic
+// on them gives the same results as the double arithmetic it replaces
+constexpr double ExactLimit = 9007199254740992.0;
+constexpr double Infinity = std::numeric_limits<double>::infinity();
+
+// Loop counters are only made integers for small starts and steps. Such a
+// counter leaves the exact range after at least 2^43 iterations, far beyond
+// any loop that terminates in practice.
+constexpr double CounterStartLimit = 2147483648.0;
+constexpr double CounterStepLimit = 1024.0;
+
+// Bounds on a value, meaningful for integers only
+struct Range {
+  ValueType type = ValueType::Double;
+  double lo = -Infinity;
+  double hi = Infinity;
+
+  bool integral() const { return type != ValueType::Double; }
+};
+
+Range integer(double lo, double hi) {
+  if (lo < -ExactLimit || hi > ExactLimit)
+    return {};
+  return {ValueType::Int, lo, hi};
+}
+
+Range literal(double val) {
+  // -0.0 would come back as +0.0
+  if (std::trunc(val) != val || (val == 0 && std::signbit(val)))
+    return {};
+  return integer(val, val);
+}
+
+Range binary(ast::OperatorKind op, Range l, Range r) {
+  using ast::OperatorKind;
+  if (op == OperatorKind::LessThan || op == OperatorKind::GreaterThan)
+    return {ValueType::Bool, 0, 1};
+  if (!l.integral() || !r.integral())
+    return {};
+
+  switch (op) {
+  case OperatorKind::Plus:
+    return integer(l.lo + r.lo, l.hi + r.hi);
+  case OperatorKind::Minus:
+    return integer(l.lo - r.hi, l.hi - r.lo);
+  case OperatorKind::Asterisk:
+    // A negative times zero is -0.0 in doubles
+    if (l.lo < 0 || r.lo < 0)
+      return {};
+    return integer(l.lo * r.lo, l.hi * r.hi);
+  default:
+    return {};
+  }
+}
+
+struct Inference {
+  ast::TypeInfo info;
+  std::unordered_map<const ast::Expr *, Range> ranges;
+  // Loop variables in scope, innermost last; anything else is a parameter
+  std::vector<std::pair<std::string_view, Range>> scope;
+
+  Range range(const ast::Expr &expr) const {
+    auto entry = ranges.find(&expr);
+    return entry == ranges.end() ? Range{} : entry->second;
+  }
+
+  Range variable(std::string_view name) const {
+    for (auto binding = scope.rbegin(); binding != scope.rend(); ++binding)
+      if (binding->first == name)
+        return binding->second;
+    return {};
+  }
+
+  // Called once the start value is known, before the rest of the loop
+  void bind(const ast::ForExpr &loop) {
+    Range start = range(*loop.Start);
+    double step = 1;
+    if (loop.Step) {
+      auto *number = loop.Step->getIf<ast::NumberExpr>();
+      step = number && literal(number->val).integral() ? number->val : Infinity;
+    }
+
+    Range counter;
+    if (start.integral() && std::abs(start.lo) <= CounterStartLimit &&
+        std::abs(start.hi) <= CounterStartLimit &&
+        std::abs(step) <= CounterStepLimit)
+      counter = step < 0 ? integer(-ExactLimit, start.hi)
+                         : integer(start.lo, ExactLimit);
+    if (counter.integral())
+      info.counters[&loop] = counter.type;
+    scope.emplace_back(loop.VarName, counter);
+  }
+
+  // Called once all operands are known
+  Range finish(ast::Expr &expr) {
+    return ast::visit(
+        ast::overloaded{
+            [](ast::NumberExpr &node) { return literal(node.val); },
+            [&](ast::VariableExpr &node) { return variable(node.name); },
+            [&](ast::BinaryExpr &node) {
+              return binary(node.op, range(*node.left), range(*node.right));
+            },
+            [&](ast::IfExpr &node) -> Range {
+              Range t = range(*node.Then), e = range(*node.Else);
+              if (!t.integral() || !e.integral())
+                return {};
+              if (t.type == ValueType::Bool && e.type == ValueType::Bool)
+                return t;
+              return integer(std::min(t.lo, e.lo), std::max(t.hi, e.hi));
+            },
+            [&](ast::ForExpr &) -> Range {
+              scope.pop_back();
+              return {};
+            },
+            [](auto &) -> Range { return {}; },
+        },
+        expr);
+  }
+};
+
+} // namespace
+
+ast::TypeInfo ast::inferTypes(FunctionDefinition &fn) {
+  enum class Stage { Enter, Bind, Exit };
+  struct Frame {
+    Expr *expr;
+    Stage stage;
+  };
+  Inference inference;
+  std::vector<Frame> work = {{fn.body.get(), Stage::Enter}};
+
+  // Operands first, like codegen; shared subtrees are not entered
+  while (!work.empty()) {
+    auto [expr, stage] = work.back();
+    work.pop_back();
+
+    if (stage == Stage::Bind) {
+      inference.bind(*expr->getIf<ForExpr>());
+    } else if (stage == Stage::Exit) {
+      Range range = inference.finish(*expr);
+      inference.ranges[expr] = range;
+      if (range.integral())
+        inference.info.values[expr] = range.type;
+    } else if (auto *loop = expr->getIf<ForExpr>()) {
+      work.push_back({expr, Stage::Exit});
+      work.push_back({loop->Body.get(), Stage::Enter});
+      if (loop->Step)
+        work.push_back({loop->Step.get(), Stage::Enter});
+      work.push_back({loop->End.get(), Stage::Enter});
+      work.push_back({expr, Stage::Bind});
+      work.push_back({loop->Start.get(), Stage::Enter});
+    } else {
+      work.push_back({expr, Stage::Exit});
+      size_t first = work.size();
+      forEachChild(*expr, [&](ExprPtr &child) {
+        work.push_back({child.get(), Stage::Enter});
+      });
+      std::reverse(work.begin() + first, work.end());
+    }
+  }
+  return std::move(inference.info);
+}
@@ -0,0 +1,58 @@
+#include "kaleidoscope.h"
+#include "engine.hpp"
+#include "logger.hpp"
+#include <algorithm>
+
+struct kaleidoscope_engine {
+  std::unique_ptr<kaleidoscope::Engine> engine;
+};
+
+void kaleidoscope_set_log_level(int level) {
+  log::setLevel(
+      static_cast<log::LoggingLevel>(std::clamp<int>(level, log::error,
+                                                     log::trace)));
+}
+
+kaleidoscope_engine *kaleidoscope_engine_create(void) {
+  auto engine = kaleidoscope::Engine::create();
+  if (!engine)
+    return nullptr;
+  return new kaleidoscope_engine{std::move(engine)};
+}
+
+kaleidoscope_engine *kaleidoscope_engine_create_speculative(unsigned threads) {
+  codegen::Options options;
+  options.SpeculativeThreads = std::max(threads, 1u);
+  auto engine = kaleidoscope::Engine::create(options);
+  if (!engine)
+    return nullptr;
+  return new kaleidoscope_engine{std::move(engine)};
+}
+
+void kaleidoscope_engine_destroy(kaleidoscope_engine *engine) {
+  delete engine;
+}
+
+kaleidoscope_module kaleidoscope_compile(kaleidoscope_engine *engine,
+                                         const char *source, size_t length) {
+  return engine->engine->compile(std::string_view(source, length)).value_or(0);
+}
+
+void *kaleidoscope_lookup(kaleidoscope_engine *engine, const char *name) {
+  return engine->engine->lookup(name);
+}
+
+int kaleidoscope_release(kaleidoscope_engine *engine,
+                         kaleidoscope_module module) {
+  return engine->engine->release(module) ? 0 : 1;
+}
+
+int kaleidoscope_emit_shared_library(kaleidoscope_engine *engine,
+                                     const char *source, size_t length,
+                                     const char *library_path,
+                                     const char *header_path) {
+  return engine->engine->emitSharedLibrary(std::string_view(source, length),
+                                           library_path, header_path)
+             ? 0
+             : 1;
+}
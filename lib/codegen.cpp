@@ -1,87 +1,481 @@
 #include "codegen.hpp"
 #include "ast/ast.hpp"
+#include "ast/passes.hpp"
+#include "ast/types.hpp"
+#include "ast/visitor.hpp"
 #include "logger.hpp"
+#include "target.hpp"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassInstrumentation.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include <cmath>
+#include <format>
 #include <map>
 #include <memory>
+#include <set>
 
-llvm::Value *ast::NumberExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
-  return llvm::ConstantFP::get(*llctx->Context, llvm::APFloat(this->val));
+namespace {
+
+struct MathFunction {
+  llvm::Intrinsic::ID intrinsic;
+  size_t arity;
+};
+
+// libm functions with an intrinsic counterpart, all overloaded on double
+const std::map<std::string, MathFunction> KnownMathFunctions = {
+    {"sqrt", {llvm::Intrinsic::sqrt, 1}},
+    {"exp", {llvm::Intrinsic::exp, 1}},
+    {"exp2", {llvm::Intrinsic::exp2, 1}},
+    {"log", {llvm::Intrinsic::log, 1}},
+    {"log2", {llvm::Intrinsic::log2, 1}},
+    {"log10", {llvm::Intrinsic::log10, 1}},
+    {"sin", {llvm::Intrinsic::sin, 1}},
+    {"cos", {llvm::Intrinsic::cos, 1}},
+    {"pow", {llvm::Intrinsic::pow, 2}},
+    {"fabs", {llvm::Intrinsic::fabs, 1}},
+    {"floor", {llvm::Intrinsic::floor, 1}},
+    {"ceil", {llvm::Intrinsic::ceil, 1}},
+    {"trunc", {llvm::Intrinsic::trunc, 1}},
+    {"round", {llvm::Intrinsic::round, 1}},
+    {"rint", {llvm::Intrinsic::rint, 1}},
+    {"nearbyint", {llvm::Intrinsic::nearbyint, 1}},
+    {"fmin", {llvm::Intrinsic::minnum, 2}},
+    {"fmax", {llvm::Intrinsic::maxnum, 2}},
+    {"copysign", {llvm::Intrinsic::copysign, 2}},
+    {"fma", {llvm::Intrinsic::fma, 3}},
+};
+
+// Operations on vector values, used when no function of the same name exists
+const std::set<std::string> VectorBuiltins = {
+    "vec2", "vec4", "vec8", "lane", "hsum", "hmin", "hmax",
+};
+
+// Value type of something with `lanes` lanes (see ast::FunctionPrototype)
+llvm::Type *lanesType(llvm::LLVMContext &context, unsigned lanes) {
+  llvm::Type *dbl = llvm::Type::getDoubleTy(context);
+  if (lanes == 1)
+    return dbl;
+  return llvm::FixedVectorType::get(dbl, lanes);
+}
+
+unsigned lanesOf(llvm::Type *type) {
+  auto *vector = llvm::dyn_cast<llvm::FixedVectorType>(type);
+  return vector ? vector->getNumElements() : 1;
+}
+
+// Lowers an expression tree into the current insertion block
+struct ExprCodegen {
+  codegen::LLVMCodegenCtx *llctx;
+  // Values proven integral or boolean are lowered to i64 and i1
+  ast::TypeInfo types;
+  // Type inferred for the node being visited
+  ast::ValueType resultType = ast::ValueType::Double;
+  // Scope of the source locations put on instructions, with debug info
+  llvm::DISubprogram *subprogram = nullptr;
+
+  void locate(const ast::Expr &expr) {
+    if (subprogram)
+      llctx->Builder->SetCurrentDebugLocation(llvm::DILocation::get(
+          *llctx->Context, expr.loc.line, expr.loc.column, subprogram));
+  }
+
+  // Values generated for shared subtrees, innermost scope last. Branches get
+  // a scope of their own so a value is only reused where it dominates; loops
+  // get a barrier that also hides the outer scopes, as the loop variable may
+  // shadow a name those values were computed from.
+  struct Scope {
+    llvm::DenseMap<const ast::Expr *, llvm::Value *> values;
+    bool barrier = false;
+  };
+  std::vector<Scope> scopes = std::vector<Scope>(1);
+
+  llvm::Value *emit(ast::Expr &root);
+
+  llvm::Value *emitScoped(ast::Expr &expr) {
+    scopes.emplace_back();
+    llvm::Value *v = emit(expr);
+    scopes.pop_back();
+    return v;
+  }
+
+  llvm::Value *operator()(ast::NumberExpr &node);
+  llvm::Value *operator()(ast::VariableExpr &node);
+  llvm::Value *operator()(ast::CallExpr &node);
+  llvm::Value *operator()(ast::IfExpr &node);
+  llvm::Value *operator()(ast::ForExpr &node);
+  // Binary operators and shared subtrees never reach the visitor
+  template <typename Node> llvm::Value *operator()(Node &) {
+    llvm_unreachable("expression kind is lowered by emit()");
+  }
+
+  llvm::Value *emitOperator(ast::OperatorKind op, ast::ValueType type,
+                            llvm::Value *l, llvm::Value *r);
+  llvm::Value *emitVectorOperator(ast::OperatorKind op, llvm::Value *l,
+                                  llvm::Value *r);
+  llvm::Value *emitVectorBuiltin(ast::CallExpr &node);
+  llvm::Value *lookupShared(const ast::Expr *key);
+
+  llvm::Type *typeFor(ast::ValueType type);
+  llvm::Value *convert(llvm::Value *v, ast::ValueType to);
+  llvm::Value *condition(llvm::Value *v, const char *name);
+};
+
+} // namespace
+
+llvm::Value *ExprCodegen::operator()(ast::NumberExpr &node) {
+  return llvm::ConstantFP::get(*llctx->Context, llvm::APFloat(node.val));
 }
 
-llvm::Value *ast::VariableExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
-  llvm::Value *v = llctx->NamedValues[this->name];
+llvm::Value *ExprCodegen::operator()(ast::VariableExpr &node) {
+  llvm::Value *v = llctx->NamedValues[node.name];
   if (!v)
-    ERROR("Unknown variable name: " << this->name);
+    ERROR("Unknown variable name: " << node.name);
   return v;
 }
 
-llvm::Value *ast::BinaryExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
-  llvm::Value *l = this->left->codegen(llctx);
-  llvm::Value *r = this->right->codegen(llctx);
+// Operator chains are walked with an explicit stack of pending nodes and
+// computed values, so their depth is bounded by memory rather than by the call
+// stack. Kinds that open blocks or scopes go through the visitor, whose
+// operands come back here.
+llvm::Value *ExprCodegen::emit(ast::Expr &root) {
+  struct Frame {
+    ast::Expr *expr;
+    // Operands already pushed; combine them on the next visit
+    bool expanded;
+  };
+  std::vector<Frame> work = {{&root, false}};
+  std::vector<llvm::Value *> values;
+
+  while (!work.empty()) {
+    auto [expr, expanded] = work.back();
+    work.pop_back();
+
+    if (auto *node = expr->getIf<ast::BinaryExpr>()) {
+      if (!expanded) {
+        work.push_back({expr, true});
+        work.push_back({node->right.get(), false});
+        work.push_back({node->left.get(), false});
+        continue;
+      }
+      llvm::Value *r = values.back();
+      values.pop_back();
+      llvm::Value *l = values.back();
+      values.pop_back();
+      locate(*expr);
+      llvm::Value *v = emitOperator(node->op, types.of(*expr), l, r);
+      if (!v)
+        return nullptr;
+      values.push_back(v);
+    } else if (auto *node = expr->getIf<ast::SharedExpr>()) {
+      const ast::Expr *key = node->expr.get();
+      if (!expanded) {
+        if (llvm::Value *v = lookupShared(key)) {
+          values.push_back(v);
+          continue;
+        }
+        work.push_back({expr, true});
+        work.push_back({node->expr.get(), false});
+        continue;
+      }
+      scopes.back().values[key] = values.back();
+    } else {
+      resultType = types.of(*expr);
+      locate(*expr);
+      llvm::Value *v = ast::visit(*this, *expr);
+      if (!v)
+        return nullptr;
+      values.push_back(convert(v, types.of(*expr)));
+    }
+  }
+  return values.back();
+}
 
-  if (!l || !r)
+llvm::Type *ExprCodegen::typeFor(ast::ValueType type) {
+  switch (type) {
+  case ast::ValueType::Bool:
+    return llvm::Type::getInt1Ty(*llctx->Context);
+  case ast::ValueType::Int:
+    return llvm::Type::getInt64Ty(*llctx->Context);
+  case ast::ValueType::Double:
+    break;
+  }
+  return llvm::Type::getDoubleTy(*llctx->Context);
+}
+
+// Conversions happen where an integer or boolean meets a double, or where a
+// boolean is used as a number; anything else is already of the right type.
+// Vectors are never inferred to be anything else and pass through.
+llvm::Value *ExprCodegen::convert(llvm::Value *v, ast::ValueType to) {
+  llvm::Type *type = typeFor(to);
+  if (v->getType() == type || v->getType()->isVectorTy())
+    return v;
+
+  auto &builder = *llctx->Builder;
+  switch (to) {
+  case ast::ValueType::Bool:
+    return condition(v, "tobool");
+  case ast::ValueType::Int:
+    if (v->getType()->isIntegerTy(1))
+      return builder.CreateZExt(v, type, "toint");
+    // Only literals proven integral get here
+    return builder.CreateFPToSI(v, type, "toint");
+  case ast::ValueType::Double:
+    if (v->getType()->isIntegerTy(1))
+      return builder.CreateUIToFP(v, type, "booltmp");
+    return builder.CreateSIToFP(v, type, "todouble");
+  }
+  return v;
+}
+
+// Truth value of a condition: anything but zero (and NaN) is true. nullptr
+// (after logging) for a vector.
+llvm::Value *ExprCodegen::condition(llvm::Value *v, const char *name) {
+  if (v->getType()->isVectorTy()) {
+    ERROR("A " << ast::typeName(lanesOf(v->getType()))
+               << " cannot be a condition; reduce it with hsum, hmin, hmax "
+                  "or lane first");
     return nullptr;
+  }
+  if (v->getType()->isIntegerTy(1))
+    return v;
+  if (v->getType()->isIntegerTy())
+    return llctx->Builder->CreateICmpNE(
+        v, llvm::ConstantInt::get(v->getType(), 0), name);
+  return llctx->Builder->CreateFCmpONE(
+      v, llvm::ConstantFP::get(*llctx->Context, llvm::APFloat(0.0)), name);
+}
+
+llvm::Value *ExprCodegen::emitOperator(ast::OperatorKind op,
+                                       ast::ValueType type, llvm::Value *l,
+                                       llvm::Value *r) {
+  if (l->getType()->isVectorTy() || r->getType()->isVectorTy())
+    return emitVectorOperator(op, l, r);
 
-  switch (this->op) {
+  auto &builder = *llctx->Builder;
+  // Integer results are exact, so the operations cannot wrap
+  bool integral = type == ast::ValueType::Int;
+  if (integral) {
+    l = convert(l, ast::ValueType::Int);
+    r = convert(r, ast::ValueType::Int);
+  }
+
+  switch (op) {
   case ast::OperatorKind::Plus:
-    return llctx->Builder->CreateFAdd(l, r, "addtmp");
+    if (integral)
+      return builder.CreateNSWAdd(l, r, "addtmp");
+    return builder.CreateFAdd(convert(l, ast::ValueType::Double),
+                              convert(r, ast::ValueType::Double), "addtmp");
   case ast::OperatorKind::Minus:
-    return llctx->Builder->CreateFSub(l, r, "subtmp");
+    if (integral)
+      return builder.CreateNSWSub(l, r, "subtmp");
+    return builder.CreateFSub(convert(l, ast::ValueType::Double),
+                              convert(r, ast::ValueType::Double), "subtmp");
   case ast::OperatorKind::Asterisk:
-    return llctx->Builder->CreateFMul(l, r, "multmp");
+    if (integral)
+      return builder.CreateNSWMul(l, r, "multmp");
+    return builder.CreateFMul(convert(l, ast::ValueType::Double),
+                              convert(r, ast::ValueType::Double), "multmp");
+  case ast::OperatorKind::LessThan: {
+    // Integers are never NaN, so the unordered compare becomes a signed one
+    llvm::Value *cmp;
+    if (l->getType()->isIntegerTy() && r->getType()->isIntegerTy())
+      cmp = builder.CreateICmpSLT(convert(l, ast::ValueType::Int),
+                                  convert(r, ast::ValueType::Int), "cmptmp");
+    else
+      cmp = builder.CreateFCmpULT(convert(l, ast::ValueType::Double),
+                                  convert(r, ast::ValueType::Double),
+                                  "cmptmp");
+    return convert(cmp, type);
+  }
+  default:
+    ERROR("Invalid binary operator");
+    return nullptr;
+  }
+}
+
+// Element-wise, one instruction per operator; a double meeting a vector is
+// broadcast to all its lanes. Comparisons give 1.0 or 0.0 per lane, like the
+// scalar ones.
+llvm::Value *ExprCodegen::emitVectorOperator(ast::OperatorKind op,
+                                             llvm::Value *l, llvm::Value *r) {
+  unsigned lanesL = lanesOf(l->getType()), lanesR = lanesOf(r->getType());
+  if (lanesL != lanesR && lanesL != 1 && lanesR != 1) {
+    ERROR("Cannot combine a " << ast::typeName(lanesL) << " with a "
+                              << ast::typeName(lanesR));
+    return nullptr;
+  }
+
+  auto &builder = *llctx->Builder;
+  unsigned lanes = std::max(lanesL, lanesR);
+  auto widen = [&](llvm::Value *v) {
+    if (v->getType()->isVectorTy())
+      return v;
+    return builder.CreateVectorSplat(lanes, convert(v, ast::ValueType::Double),
+                                     "splat");
+  };
+  l = widen(l);
+  r = widen(r);
+
+  switch (op) {
+  case ast::OperatorKind::Plus:
+    return builder.CreateFAdd(l, r, "addtmp");
+  case ast::OperatorKind::Minus:
+    return builder.CreateFSub(l, r, "subtmp");
+  case ast::OperatorKind::Asterisk:
+    return builder.CreateFMul(l, r, "multmp");
   case ast::OperatorKind::LessThan:
-    l = llctx->Builder->CreateFCmpULT(l, r, "cmptmp");
-    // bool -> double
-    return llctx->Builder->CreateUIToFP(
-        l, llvm::Type::getDoubleTy(*llctx->Context), "booltmp");
+    return builder.CreateUIToFP(builder.CreateFCmpULT(l, r, "cmptmp"),
+                                l->getType(), "booltmp");
   default:
     ERROR("Invalid binary operator");
     return nullptr;
   }
 }
 
-llvm::Value *ast::CallExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
-  llvm::Function *calleeF = llctx->Module->getFunction(this->callee);
+// vecN(x) broadcasts x, vecN(x1, ..., xN) builds a vector from its lanes,
+// lane(v, i) reads lane i (a literal) and hsum, hmin and hmax reduce a vector
+// to a double
+llvm::Value *ExprCodegen::emitVectorBuiltin(ast::CallExpr &node) {
+  auto &builder = *llctx->Builder;
+  const std::string &name = node.callee;
+
+  if (name.starts_with("vec")) {
+    unsigned lanes = std::stoul(name.substr(3));
+    if (node.args.size() != 1 && node.args.size() != lanes) {
+      ERROR(name << " takes 1 or " << lanes << " doubles");
+      return nullptr;
+    }
+    std::vector<llvm::Value *> values;
+    for (auto &arg : node.args) {
+      llvm::Value *v = emit(*arg);
+      if (!v)
+        return nullptr;
+      if (v->getType()->isVectorTy()) {
+        ERROR(name << " takes doubles, not a "
+                   << ast::typeName(lanesOf(v->getType())));
+        return nullptr;
+      }
+      values.push_back(convert(v, ast::ValueType::Double));
+    }
+    if (values.size() == 1)
+      return builder.CreateVectorSplat(lanes, values[0], "splat");
+    // Literal lanes fold into a constant vector
+    llvm::Value *vector =
+        llvm::PoisonValue::get(lanesType(*llctx->Context, lanes));
+    for (unsigned i = 0; i < lanes; ++i)
+      vector = builder.CreateInsertElement(vector, values[i], uint64_t(i),
+                                           "vecinit");
+    return vector;
+  }
+
+  size_t arity = name == "lane" ? 2 : 1;
+  if (node.args.size() != arity) {
+    ERROR(name << " takes " << arity << " argument" << (arity > 1 ? "s" : ""));
+    return nullptr;
+  }
+  llvm::Value *vector = emit(*node.args[0]);
+  if (!vector)
+    return nullptr;
+  if (!vector->getType()->isVectorTy()) {
+    ERROR(name << " takes a vector, not a double");
+    return nullptr;
+  }
+  unsigned lanes = lanesOf(vector->getType());
+
+  if (name == "lane") {
+    // A literal index selects the lane at compile time
+    auto *index = node.args[1]->getIf<ast::NumberExpr>();
+    if (!index || !(index->val >= 0 && index->val < lanes) ||
+        index->val != std::trunc(index->val)) {
+      ERROR("The lane of a " << ast::typeName(lanes)
+                             << " must be a literal from 0 to " << lanes - 1);
+      return nullptr;
+    }
+    return builder.CreateExtractElement(vector, uint64_t(index->val), "lane");
+  }
+  if (name == "hmin")
+    return builder.CreateFPMinReduce(vector);
+  if (name == "hmax")
+    return builder.CreateFPMaxReduce(vector);
+  // Starting from -0.0 keeps the sum exact; the adds are done in lane order
+  // unless reassociation is allowed
+  return builder.CreateFAddReduce(
+      llvm::ConstantFP::getNegativeZero(builder.getDoubleTy()), vector);
+}
+
+llvm::Value *ExprCodegen::operator()(ast::CallExpr &node) {
+  llvm::Function *calleeF = codegen::getFunction(llctx, node.callee);
+  if (!calleeF && VectorBuiltins.contains(node.callee))
+    return emitVectorBuiltin(node);
   if (!calleeF) {
-    ERROR("Referenced unknown function: " << this->callee);
+    ERROR("Referenced unknown function: " << node.callee);
     return nullptr;
   }
 
   // Argument mismatch error
-  if (calleeF->arg_size() != this->args.size()) {
+  if (calleeF->arg_size() != node.args.size()) {
     ERROR("Incorrect number of arguments passed");
     return nullptr;
   }
 
   std::vector<llvm::Value *> argsVec;
-  for (uint32_t i = 0, size = this->args.size(); i != size; ++i) {
-    argsVec.push_back(this->args[i]->codegen(llctx));
-    if (!argsVec.back())
+  for (uint32_t i = 0, size = node.args.size(); i != size; ++i) {
+    llvm::Value *arg = emit(*node.args[i]);
+    if (!arg)
       return nullptr;
+    arg = convert(arg, ast::ValueType::Double);
+    llvm::Type *param = calleeF->getFunctionType()->getParamType(i);
+    if (arg->getType() != param) {
+      ERROR("Argument " << i + 1 << " of " << node.callee << " must be a "
+                        << ast::typeName(lanesOf(param)) << ", not a "
+                        << ast::typeName(lanesOf(arg->getType())));
+      return nullptr;
+    }
+    argsVec.push_back(arg);
   }
 
-  return llctx->Builder->CreateCall(calleeF, argsVec, "calltmp");
+  // The call carries the callee's effects, so that GVN and LICM can merge
+  // and hoist it without looking the callee up
+  llvm::CallInst *call =
+      llctx->Builder->CreateCall(calleeF, argsVec, "calltmp");
+  if (calleeF->doesNotAccessMemory())
+    call->setDoesNotAccessMemory();
+  if (calleeF->doesNotThrow())
+    call->setDoesNotThrow();
+  if (calleeF->willReturn())
+    call->addFnAttr(llvm::Attribute::WillReturn);
+  return call;
 }
 
-llvm::Value *ast::IfExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
-  llvm::Value *condV = this->Cond->codegen(llctx);
+llvm::Value *ExprCodegen::operator()(ast::IfExpr &node) {
+  // Both branches produce a value of the type of the whole conditional
+  ast::ValueType type = resultType;
+
+  llvm::Value *condV = emit(*node.Cond);
+  if (!condV)
+    return nullptr;
+  condV = condition(condV, "ifcond");
   if (!condV)
     return nullptr;
-
-  // condition -> bool
-  condV = llctx->Builder->CreateFCmpONE(
-      condV, llvm::ConstantFP::get(*llctx->Context, llvm::APFloat(0.0)),
-      "ifcond");
 
   llvm::Function *function = llctx->Builder->GetInsertBlock()->getParent();
   // create blocks for then & else; insert 'then' at the end
@@ -96,9 +490,10 @@ llvm::Value *ast::IfExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
   // Emit then
   llctx->Builder->SetInsertPoint(thenBB);
 
-  llvm::Value *thenV = this->Then->codegen(llctx);
+  llvm::Value *thenV = emitScoped(*node.Then);
   if (!thenV)
     return nullptr;
+  thenV = convert(thenV, type);
   llctx->Builder->CreateBr(mergeBB);
 
   // Update because codegen of 'then' can change the current block
@@ -108,9 +503,10 @@ llvm::Value *ast::IfExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
   function->insert(function->end(), elseBB);
   llctx->Builder->SetInsertPoint(elseBB);
 
-  llvm::Value *elseV = this->Else->codegen(llctx);
+  llvm::Value *elseV = emitScoped(*node.Else);
   if (!elseV)
     return nullptr;
+  elseV = convert(elseV, type);
   llctx->Builder->CreateBr(mergeBB);
 
   // Update because codegen of 'else' can change the current block
@@ -119,18 +515,73 @@ llvm::Value *ast::IfExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
   // Emit merge block
   function->insert(function->end(), mergeBB);
   llctx->Builder->SetInsertPoint(mergeBB);
-  llvm::PHINode *pn = llctx->Builder->CreatePHI(
-      llvm::Type::getDoubleTy(*llctx->Context), 2, "iftmp");
+  llvm::Type *phiType = typeFor(type);
+  if (thenV->getType()->isVectorTy() || elseV->getType()->isVectorTy()) {
+    if (thenV->getType() != elseV->getType()) {
+      ERROR("The branches of a conditional give a "
+            << ast::typeName(lanesOf(thenV->getType())) << " and a "
+            << ast::typeName(lanesOf(elseV->getType())));
+      return nullptr;
+    }
+    phiType = thenV->getType();
+  }
+  llvm::PHINode *pn = llctx->Builder->CreatePHI(phiType, 2, "iftmp");
   pn->addIncoming(thenV, thenBB);
   pn->addIncoming(elseV, elseBB);
 
   return pn;
 }
 
-llvm::Value *ast::ForExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
-  llvm::Value *startVal = this->Start->codegen(llctx);
+// `llvm.loop` properties for the loop's annotations; nullptr without any
+static llvm::MDNode *loopMetadata(llvm::LLVMContext &ctx,
+                                  const ast::LoopHints &hints) {
+  auto property = [&](const char *name,
+                      llvm::Constant *value = nullptr) -> llvm::Metadata * {
+    llvm::SmallVector<llvm::Metadata *, 2> ops = {
+        llvm::MDString::get(ctx, name)};
+    if (value)
+      ops.push_back(llvm::ConstantAsMetadata::get(value));
+    return llvm::MDNode::get(ctx, ops);
+  };
+  auto count = [&](unsigned n) {
+    return llvm::ConstantInt::get(llvm::Type::getInt32Ty(ctx), n);
+  };
+
+  // The first operand is the loop ID itself, which keeps each loop's node
+  // distinct
+  llvm::SmallVector<llvm::Metadata *, 4> ops = {nullptr};
+  if (hints.unroll)
+    ops.push_back(property("llvm.loop.unroll.count", count(hints.unroll)));
+  if (hints.noUnroll)
+    ops.push_back(property("llvm.loop.unroll.disable"));
+  if (hints.vectorize) {
+    // A width of 1 asks for the loop to stay scalar
+    ops.push_back(
+        property("llvm.loop.vectorize.enable",
+                 llvm::ConstantInt::getBool(ctx, hints.vectorize > 1)));
+    ops.push_back(
+        property("llvm.loop.vectorize.width", count(hints.vectorize)));
+  }
+  if (ops.size() == 1)
+    return nullptr;
+  llvm::MDNode *loopID = llvm::MDNode::getDistinct(ctx, ops);
+  loopID->replaceOperandWith(0, loopID);
+  return loopID;
+}
+
+llvm::Value *ExprCodegen::operator()(ast::ForExpr &node) {
+  // An integer counter gives the loop optimisers an induction variable they
+  // can compute trip counts for
+  ast::ValueType counterType = types.counter(node);
+
+  llvm::Value *startVal = emit(*node.Start);
   if (!startVal)
     return nullptr;
+  if (startVal->getType()->isVectorTy()) {
+    ERROR("Loop variable " << node.VarName << " must start from a double");
+    return nullptr;
+  }
+  startVal = convert(startVal, counterType);
 
   llvm::Function *function = llctx->Builder->GetInsertBlock()->getParent();
   llvm::BasicBlock *preheaderBB = llctx->Builder->GetInsertBlock();
@@ -141,69 +592,140 @@ llvm::Value *ast::ForExpr::codegen(codegen::LLVMCodegenCtx *llctx) {
 
   llctx->Builder->SetInsertPoint(loopBB);
   // PHI node with Start entry
-  llvm::PHINode *variable = llctx->Builder->CreatePHI(
-      llvm::Type::getDoubleTy(*llctx->Context), 2, this->VarName);
+  llvm::PHINode *variable =
+      llctx->Builder->CreatePHI(typeFor(counterType), 2, node.VarName);
   variable->addIncoming(startVal, preheaderBB);
 
   // Shadow existing variable under the same name but preserve
-  llvm::Value *oldVal = llctx->NamedValues[this->VarName];
-  llctx->NamedValues[this->VarName] = variable;
+  llvm::Value *oldVal = llctx->NamedValues[node.VarName];
+  llctx->NamedValues[node.VarName] = variable;
+
+  // Body, step and end condition all run once per iteration
+  scopes.push_back({{}, true});
 
   // Emit loop body
-  if (!this->Body->codegen(llctx))
+  if (!emit(*node.Body))
     return nullptr;
 
   // Emit step
   llvm::Value *stepVal = nullptr;
-  if (this->Step) {
-    stepVal = this->Step->codegen(llctx);
+  if (node.Step) {
+    stepVal = emit(*node.Step);
     if (!stepVal)
       return nullptr;
+    if (stepVal->getType()->isVectorTy()) {
+      ERROR("The step of loop " << node.VarName << " must be a double");
+      return nullptr;
+    }
+    stepVal = convert(stepVal, counterType);
   } else {
-    // use 1.0 as default
-    stepVal = llvm::ConstantFP::get(*llctx->Context, llvm::APFloat(1.0));
+    // use 1 as default
+    stepVal = convert(
+        llvm::ConstantFP::get(*llctx->Context, llvm::APFloat(1.0)),
+        counterType);
   }
 
   llvm::Value *nextVar =
-      llctx->Builder->CreateFAdd(variable, stepVal, "nextvar");
+      counterType == ast::ValueType::Int
+          ? llctx->Builder->CreateNSWAdd(variable, stepVal, "nextvar")
+          : llctx->Builder->CreateFAdd(variable, stepVal, "nextvar");
 
   // Compute end condition
-  llvm::Value *endCond = this->End->codegen(llctx);
+  llvm::Value *endCond = emit(*node.End);
   if (!endCond)
     return nullptr;
 
-  // cond -> bool; cmp not-equal to 0
-  endCond = llctx->Builder->CreateFCmpONE(
-      endCond, llvm::ConstantFP::get(*llctx->Context, llvm::APFloat(0.0)),
-      "loopcond");
+  endCond = condition(endCond, "loopcond");
+  if (!endCond)
+    return nullptr;
 
   // create the "after loop" block and insert it
   llvm::BasicBlock *loopEndBB = llctx->Builder->GetInsertBlock();
   llvm::BasicBlock *afterBB =
       llvm::BasicBlock::Create(*llctx->Context, "afterloop", function);
-  llctx->Builder->CreateCondBr(endCond, loopBB, afterBB);
+  llvm::BranchInst *backedge =
+      llctx->Builder->CreateCondBr(endCond, loopBB, afterBB);
+  if (llvm::MDNode *loopID = loopMetadata(*llctx->Context, node.hints))
+    backedge->setMetadata(llvm::LLVMContext::MD_loop, loopID);
   llctx->Builder->SetInsertPoint(afterBB);
 
   variable->addIncoming(nextVar, loopEndBB);
+  scopes.pop_back();
 
   // Restore the unshadowed variable
   if (oldVal)
-    llctx->NamedValues[this->VarName] = oldVal;
+    llctx->NamedValues[node.VarName] = oldVal;
   else
-    llctx->NamedValues.erase(this->VarName);
+    llctx->NamedValues.erase(node.VarName);
 
   return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*llctx->Context));
 }
 
+llvm::Value *ExprCodegen::lookupShared(const ast::Expr *key) {
+  for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+    if (llvm::Value *v = scope->values.lookup(key))
+      return v;
+    if (scope->barrier)
+      break;
+  }
+  return nullptr;
+}
+
+// Attributes every generated function carries, whatever it computes
+static void addCodegenAttributes(codegen::LLVMCodegenCtx &llctx,
+                                 llvm::Function &f) {
+  // Let the backend relax whatever the IR flags relax
+  const llvm::FastMathFlags &fmf = llctx.Opts.FastMath;
+  if (fmf.isFast())
+    f.addFnAttr("unsafe-fp-math", "true");
+  if (fmf.noNaNs())
+    f.addFnAttr("no-nans-fp-math", "true");
+  if (fmf.noInfs())
+    f.addFnAttr("no-infs-fp-math", "true");
+  if (fmf.noSignedZeros())
+    f.addFnAttr("no-signed-zeros-fp-math", "true");
+  if (fmf.approxFunc())
+    f.addFnAttr("approx-func-fp-math", "true");
+
+  if (llctx.TM) {
+    f.addFnAttr("target-cpu", llctx.TM->getTargetCPU());
+    f.addFnAttr("target-features", llctx.TM->getTargetFeatureString());
+  }
+  if (llctx.Opts.FramePointers)
+    f.addFnAttr("frame-pointer", "all");
+}
+
 llvm::Function *
-ast::FunctionPrototype::codegen(codegen::LLVMCodegenCtx *llctx) {
-  // Function type, e.g. double(double, double)
-  std::vector<llvm::Type *> doubles(this->args.size(),
-                                    llvm::Type::getDoubleTy(*llctx->Context));
+ast::FunctionPrototype::codegen(codegen::LLVMCodegenCtx *llctx) const {
+  // Function type, e.g. double(double, double) or <4 x double>(<4 x double>)
+  std::vector<llvm::Type *> params;
+  for (unsigned lanes : this->argLanes)
+    params.push_back(lanesType(*llctx->Context, lanes));
   llvm::FunctionType *ft = llvm::FunctionType::get(
-      llvm::Type::getDoubleTy(*llctx->Context), doubles, false);
+      lanesType(*llctx->Context, this->lanes), params, false);
   llvm::Function *f = llvm::Function::Create(
-      ft, llvm::Function::ExternalLinkage, this->name, llctx->Module.get());
+      ft, llvm::Function::ExternalLinkage,
+      this->name.empty() ? codegen::AnonExprName : this->name,
+      llctx->Module.get());
+
+  addCodegenAttributes(*llctx, *f);
+
+  // Annotations and inferred effects, on declarations too so that calls from
+  // other modules see them
+  if (hints.alwaysInline)
+    f->addFnAttr(llvm::Attribute::AlwaysInline);
+  if (hints.noInline)
+    f->addFnAttr(llvm::Attribute::NoInline);
+  if (hints.hot)
+    f->addFnAttr(llvm::Attribute::Hot);
+  if (hints.cold)
+    f->addFnAttr(llvm::Attribute::Cold);
+  if (hints.pure || effects.pure) {
+    f->setDoesNotAccessMemory();
+    f->setDoesNotThrow();
+  }
+  if (hints.pure || effects.willReturn)
+    f->setWillReturn();
 
   // Set argument names
   uint32_t idx = 0;
@@ -213,10 +735,39 @@ ast::FunctionPrototype::codegen(codegen::LLVMCodegenCtx *llctx) {
   return f;
 }
 
+// Debug info for the function defined at `proto`
+static llvm::DISubprogram *
+describeFunction(codegen::LLVMCodegenCtx &llctx, llvm::Function &function,
+                 const ast::FunctionPrototype &proto) {
+  llvm::DIBuilder &dib = *llctx.DIB;
+  llvm::DIType *dbl =
+      dib.createBasicType("double", 64, llvm::dwarf::DW_ATE_float);
+  auto type = [&](unsigned lanes) -> llvm::DIType * {
+    if (lanes == 1)
+      return dbl;
+    return dib.createVectorType(
+        64 * lanes, 64 * lanes, dbl,
+        dib.getOrCreateArray({dib.getOrCreateSubrange(0, lanes)}));
+  };
+  llvm::SmallVector<llvm::Metadata *> types = {type(proto.lanes)};
+  for (unsigned lanes : proto.argLanes)
+    types.push_back(type(lanes));
+  llvm::DIFile *file = llctx.DICU->getFile();
+
+  llvm::DISubprogram *subprogram = dib.createFunction(
+      file, function.getName(), function.getName(), file, proto.loc.line,
+      dib.createSubroutineType(dib.getOrCreateTypeArray(types)),
+      proto.loc.line, llvm::DINode::FlagPrototyped,
+      llvm::DISubprogram::SPFlagDefinition);
+  function.setSubprogram(subprogram);
+  return subprogram;
+}
+
 llvm::Function *
 ast::FunctionDefinition::codegen(codegen::LLVMCodegenCtx *llctx) {
   // Check if a function prototype already exists
-  llvm::Function *function = llctx->Module->getFunction(this->proto->getName());
+  llvm::Function *function =
+      codegen::getFunction(llctx, this->proto->getName());
 
   if (!function)
     function = this->proto->codegen(llctx);
@@ -228,6 +779,11 @@ ast::FunctionDefinition::codegen(codegen::LLVMCodegenCtx *llctx) {
     ERROR("Function " << this->proto->getName() << " cannot be redefined.");
     return nullptr;
   }
+  if (function->isIntrinsic()) {
+    ERROR("Function " << this->proto->getName()
+                      << " is a math extern and cannot be defined.");
+    return nullptr;
+  }
 
   // Create a new basic block
   llvm::BasicBlock *bb =
@@ -239,9 +795,31 @@ ast::FunctionDefinition::codegen(codegen::LLVMCodegenCtx *llctx) {
   for (auto &arg : function->args())
     llctx->NamedValues[std::string(arg.getName())] = &arg;
 
-  if (llvm::Value *retVal = this->body->codegen(llctx)) {
+  ExprCodegen gen{llctx};
+  if (llctx->Opts.InferTypes)
+    gen.types = ast::inferTypes(*this);
+  if (llctx->DIB)
+    gen.subprogram = describeFunction(*llctx, *function, *this->proto);
+
+  llvm::Value *retVal = gen.emit(*this->body);
+  if (retVal) {
+    retVal = gen.convert(retVal, ast::ValueType::Double);
+    if (retVal->getType() != function->getReturnType()) {
+      ERROR((proto->getName().empty() ? "A top-level expression"
+                                      : "Function " + proto->getName())
+            << " must return a " << typeName(lanesOf(function->getReturnType()))
+            << ", not a " << typeName(lanesOf(retVal->getType())));
+      retVal = nullptr;
+    }
+  }
+  if (retVal)
     llctx->Builder->CreateRet(retVal);
+  // Code generated later must not pick up this function's locations
+  llctx->Builder->SetCurrentDebugLocation(llvm::DebugLoc());
+  if (gen.subprogram)
+    llctx->DIB->finalizeSubprogram(gen.subprogram);
 
+  if (retVal) {
     // Validate generated code
     llvm::verifyFunction(*function);
 
@@ -254,14 +832,28 @@ ast::FunctionDefinition::codegen(codegen::LLVMCodegenCtx *llctx) {
 }
 
 llvm::Module *ast::CompilationUnit::codegen(codegen::LLVMCodegenCtx *llctx) {
+  for (auto &proto : this->externs)
+    codegen::declareExtern(llctx, proto.get());
+
+  // Functions may be called before their definition
+  for (auto &fn : this->functions)
+    if (!fn->proto->getName().empty())
+      llctx->FunctionProtos.try_emplace(fn->proto->getName(), fn->proto.get());
+
   std::vector<llvm::Function *> fnIRs;
   // Codegen all functions
-  for (auto &fn : this->functions)
-    fnIRs.push_back(fn->codegen(llctx));
+  for (auto &fn : this->functions) {
+    llvm::Function *fnIR = fn->codegen(llctx);
+    if (!fnIR)
+      return nullptr;
+    fnIRs.push_back(fnIR);
+  }
+
+  codegen::finishModule(*llctx);
 
   DEBUG("*** Unoptimised codegen ***");
-  if (LoggingLevel == log::debug)
-    llctx->Module->print(llvm::outs(), nullptr);
+  if (log::enabled(log::debug) && log::currentLevel() == log::debug)
+    llctx->Module->print(log::Record(log::debug, false).stream(), nullptr);
 
   // Optimise all functions
   for (auto fnIR : fnIRs)
@@ -270,14 +862,14 @@ llvm::Module *ast::CompilationUnit::codegen(codegen::LLVMCodegenCtx *llctx) {
   return &*llctx->Module;
 }
 
-void codegen::codegen(ast::CompilationUnit *ast) {
+std::unique_ptr<codegen::LLVMCodegenCtx>
+codegen::createContext(const std::string &moduleName, const Options &options,
+                       llvm::TargetMachine *tm) {
   // Prepare the context struct
-  LLVMCodegenCtx llctx;
-
-  // Initialise module
-  llctx.Context = std::make_unique<llvm::LLVMContext>();
-  llctx.Module = std::make_unique<llvm::Module>(ast->name, *llctx.Context);
-  llctx.Builder = std::make_unique<llvm::IRBuilder<>>(*llctx.Context);
+  auto ctx = std::make_unique<LLVMCodegenCtx>();
+  LLVMCodegenCtx &llctx = *ctx;
+  llctx.Opts = options;
+  llctx.TM = tm;
 
   // Crceate pass and analysis managers
   llctx.FPM = std::make_unique<llvm::FunctionPassManager>();
@@ -286,30 +878,306 @@ void codegen::codegen(ast::CompilationUnit *ast) {
   llctx.CGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
   llctx.MAM = std::make_unique<llvm::ModuleAnalysisManager>();
   llctx.MPM = std::make_unique<llvm::ModulePassManager>();
-  llctx.PIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
-  llctx.SI =
-      std::make_unique<llvm::StandardInstrumentations>(*llctx.Context, true);
 
-  llctx.SI->registerCallbacks(*llctx.PIC, llctx.MAM.get());
+  if (options.OptReport)
+    llctx.Report = std::make_unique<report::OptReport>();
+
+  // Initialise module
+  resetContext(llctx, moduleName);
 
   // Add function transform passes
   llctx.FPM->addPass(llvm::InstCombinePass());
   llctx.FPM->addPass(llvm::ReassociatePass());
   llctx.FPM->addPass(llvm::GVNPass());
   llctx.FPM->addPass(llvm::SimplifyCFGPass());
+  // Only loops annotated with @unroll are unrolled, and only @vectorize
+  // loops vectorised unless -fveclib asks for vectorised libm calls
+  bool vectorizeAll = options.VecLib != llvm::TargetLibraryInfoImpl::NoLibrary;
+  llctx.FPM->addPass(llvm::LoopVectorizePass(
+      llvm::LoopVectorizeOptions(true, !vectorizeAll)));
+  llctx.FPM->addPass(llvm::LoopUnrollPass(llvm::LoopUnrollOptions(2, true)));
+
+  // Module passes run once all functions are generated: inline the @inline
+  // functions into their callers in the same module
+  llctx.MPM->addPass(llvm::AlwaysInlinerPass());
+
+  // Must be registered before the builder's default library info
+  llvm::Triple triple(tm ? tm->getTargetTriple().str()
+                         : llvm::sys::getDefaultTargetTriple());
+  llctx.TLII = std::make_unique<llvm::TargetLibraryInfoImpl>(triple);
+  llctx.TLII->addVectorizableFunctionsFromVecLib(options.VecLib, triple);
+  llctx.FAM->registerPass(
+      [tlii = llctx.TLII.get()] { return llvm::TargetLibraryAnalysis(*tlii); });
+
+  llctx.PB = std::make_unique<llvm::PassBuilder>(
+      tm, llvm::PipelineTuningOptions(), std::nullopt,
+      llctx.Report ? &llctx.Report->instrumentation() : nullptr);
+  llctx.PB->registerModuleAnalyses(*llctx.MAM);
+  llctx.PB->registerCGSCCAnalyses(*llctx.CGAM);
+  llctx.PB->registerFunctionAnalyses(*llctx.FAM);
+  llctx.PB->registerLoopAnalyses(*llctx.LAM);
+  llctx.PB->crossRegisterProxies(*llctx.LAM, *llctx.FAM, *llctx.CGAM,
+                                 *llctx.MAM);
+
+  return ctx;
+}
+
+void codegen::resetContext(LLVMCodegenCtx &llctx,
+                           const std::string &moduleName) {
+  // Everything tied to the old context goes before it
+  llctx.FAM->clear();
+  llctx.CGAM->clear();
+  llctx.LAM->clear();
+  llctx.MAM->clear();
+  llctx.NamedValues.clear();
+  llctx.DIB.reset();
+  llctx.Module.reset();
+  llctx.Builder.reset();
+  llctx.SI.reset();
+
+  llctx.Context = std::make_unique<llvm::LLVMContext>();
+  llctx.Builder = std::make_unique<llvm::IRBuilder<>>(*llctx.Context);
+  llctx.Builder->setFastMathFlags(llctx.Opts.FastMath);
+  if (llctx.Report)
+    llctx.Report->attach(*llctx.Context);
+
+  llctx.PIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
+  llctx.SI =
+      std::make_unique<llvm::StandardInstrumentations>(*llctx.Context, true);
+  llctx.SI->registerCallbacks(*llctx.PIC, llctx.MAM.get());
+
+  startModule(llctx, moduleName);
+}
+
+void codegen::startModule(LLVMCodegenCtx &llctx, const std::string &name) {
+  llctx.DIB.reset();
+  llctx.Module = std::make_unique<llvm::Module>(name, *llctx.Context);
+  if (llctx.TM)
+    target::configureModule(*llctx.Module, *llctx.TM);
+
+  if (llctx.Opts.DebugInfo) {
+    llctx.Module->addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                                llvm::DEBUG_METADATA_VERSION);
+    llctx.Module->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+    llctx.DIB = std::make_unique<llvm::DIBuilder>(*llctx.Module);
+    llctx.DICU = llctx.DIB->createCompileUnit(
+        llvm::dwarf::DW_LANG_C,
+        llctx.DIB->createFile(llvm::sys::path::filename(name),
+                              llvm::sys::path::parent_path(name)),
+        "kaleidoscope", true, "", 0, "",
+        llvm::DICompileUnit::LineTablesOnly);
+  }
+}
 
-  llvm::PassBuilder pb;
-  pb.registerModuleAnalyses(*llctx.MAM);
-  pb.registerFunctionAnalyses(*llctx.FAM);
-  pb.crossRegisterProxies(*llctx.LAM, *llctx.FAM, *llctx.CGAM, *llctx.MAM);
+void codegen::finishModule(LLVMCodegenCtx &llctx) {
+  if (llctx.DIB)
+    llctx.DIB->finalize();
+}
+
+llvm::Function *codegen::getFunction(LLVMCodegenCtx *llctx,
+                                     const std::string &name) {
+  auto intrinsic = llctx->MathIntrinsics.find(name);
+  if (intrinsic != llctx->MathIntrinsics.end())
+    return llvm::Intrinsic::getDeclaration(
+        llctx->Module.get(), intrinsic->second,
+        {llvm::Type::getDoubleTy(*llctx->Context)});
+
+  if (llvm::Function *f = llctx->Module->getFunction(name))
+    return f;
+
+  // Known elsewhere (later in the file, another file): declare it here
+  auto proto = llctx->FunctionProtos.find(name);
+  if (proto != llctx->FunctionProtos.end())
+    return proto->second->codegen(llctx);
+
+  return nullptr;
+}
+
+bool codegen::isMathFunction(const ast::FunctionPrototype &proto) {
+  auto known = KnownMathFunctions.find(proto.getName());
+  return known != KnownMathFunctions.end() &&
+         known->second.arity == proto.args.size() && !proto.usesVectors();
+}
+
+bool codegen::isVectorBuiltin(const std::string &name) {
+  return VectorBuiltins.contains(name);
+}
+
+void codegen::declareExtern(LLVMCodegenCtx *llctx,
+                            const ast::FunctionPrototype *proto) {
+  const std::string &name = proto->getName();
+  if (isMathFunction(*proto)) {
+    llctx->MathIntrinsics[name] = KnownMathFunctions.at(name).intrinsic;
+    return;
+  }
+  if (auto known = KnownMathFunctions.find(name);
+      known != KnownMathFunctions.end())
+    WARN("extern " << name << " is not declared as the math function "
+                   << name << "(" << known->second.arity
+                   << " doubles); calling it as declared");
+  llctx->FunctionProtos[name] = proto;
+}
+
+std::unique_ptr<codegen::LLVMCodegenCtx>
+codegen::codegen(ast::CompilationUnit *ast, const Options &options,
+                 llvm::TargetMachine *tm) {
+  auto ctx = createContext(ast->name, options, tm);
+  LLVMCodegenCtx &llctx = *ctx;
 
   DEBUG("*** Starting codegen ***");
+  ast::inferEffects({ast});
   llvm::Module *module = ast->codegen(&llctx);
+  if (!module)
+    return nullptr;
 
   // Run optimisations on the module
   llctx.MPM->run(*module, *llctx.MAM);
 
   DEBUG("*** Optimised codegen ***");
-  if (LoggingLevel == log::debug)
-    module->print(llvm::outs(), nullptr);
+  if (log::enabled(log::debug) && log::currentLevel() == log::debug)
+    module->print(log::Record(log::debug, false).stream(), nullptr);
+
+  return ctx;
+}
+
+llvm::Function *codegen::addBatchEntry(LLVMCodegenCtx &llctx,
+                                       llvm::Function &f) {
+  llvm::LLVMContext &context = *llctx.Context;
+  llvm::IRBuilder<> &builder = *llctx.Builder;
+  llvm::Type *ptr = llvm::PointerType::getUnqual(context);
+  llvm::Type *i64 = llvm::Type::getInt64Ty(context);
+  llvm::Type *dbl = llvm::Type::getDoubleTy(context);
+
+  llvm::Function *batch = llvm::Function::Create(
+      llvm::FunctionType::get(builder.getVoidTy(), {ptr, ptr, i64}, false),
+      llvm::Function::ExternalLinkage, f.getName() + BatchSuffix,
+      *llctx.Module);
+  // Not f's own attributes: the batch reads and writes memory, and the
+  // hints on f are about f
+  addCodegenAttributes(llctx, *batch);
+  llvm::Argument *columns = batch->getArg(0);
+  llvm::Argument *out = batch->getArg(1);
+  llvm::Argument *rows = batch->getArg(2);
+  columns->setName("columns");
+  out->setName("out");
+  rows->setName("rows");
+  // The output never overlaps the inputs, so no runtime alias checks
+  out->addAttr(llvm::Attribute::NoAlias);
+
+  auto *entryBB = llvm::BasicBlock::Create(context, "entry", batch);
+  auto *loopBB = llvm::BasicBlock::Create(context, "loop", batch);
+  auto *exitBB = llvm::BasicBlock::Create(context, "exit", batch);
+
+  builder.SetInsertPoint(entryBB);
+  std::vector<llvm::Value *> bases;
+  for (unsigned i = 0; i < f.arg_size(); ++i) {
+    llvm::Value *slot = builder.CreateConstInBoundsGEP1_64(ptr, columns, i);
+    bases.push_back(builder.CreateLoad(ptr, slot, "column"));
+  }
+  builder.CreateCondBr(
+      builder.CreateICmpEQ(rows, llvm::ConstantInt::get(i64, 0)), exitBB,
+      loopBB);
+
+  builder.SetInsertPoint(loopBB);
+  llvm::PHINode *row = builder.CreatePHI(i64, 2, "row");
+  row->addIncoming(llvm::ConstantInt::get(i64, 0), entryBB);
+  std::vector<llvm::Value *> args;
+  for (llvm::Value *base : bases)
+    args.push_back(builder.CreateLoad(
+        dbl, builder.CreateInBoundsGEP(dbl, base, row), "arg"));
+  llvm::Value *result = builder.CreateCall(&f, args, "result");
+  builder.CreateStore(result, builder.CreateInBoundsGEP(dbl, out, row));
+  llvm::Value *next = builder.CreateNUWAdd(
+      row, llvm::ConstantInt::get(i64, 1), "nextrow");
+  row->addIncoming(next, loopBB);
+  builder.CreateCondBr(builder.CreateICmpULT(next, rows), loopBB, exitBB);
+
+  builder.SetInsertPoint(exitBB);
+  builder.CreateRetVoid();
+
+  llvm::verifyFunction(*batch);
+  return batch;
+}
+
+// Every call site of an internal function is known, so it may use the
+// faster, non-ABI calling convention
+static void useFastCC(llvm::Module &module) {
+  for (llvm::Function &f : module) {
+    if (f.isDeclaration() || !f.hasLocalLinkage() || f.hasAddressTaken())
+      continue;
+
+    f.setCallingConv(llvm::CallingConv::Fast);
+    for (llvm::User *user : f.users())
+      if (auto *call = llvm::dyn_cast<llvm::CallBase>(user))
+        call->setCallingConv(llvm::CallingConv::Fast);
+  }
+}
+
+std::unique_ptr<codegen::LLVMCodegenCtx> codegen::codegenWholeProgram(
+    const std::vector<ast::CompilationUnit *> &units,
+    const std::vector<std::string> &entryPoints, const Options &options,
+    llvm::TargetMachine *tm) {
+  auto ctx = createContext("whole-program", options, tm);
+  LLVMCodegenCtx &llctx = *ctx;
+
+  // Every file can call any function of any other file
+  ast::inferEffects(units);
+  for (ast::CompilationUnit *unit : units) {
+    for (auto &proto : unit->externs)
+      declareExtern(&llctx, proto.get());
+    for (auto &fn : unit->functions)
+      if (!fn->proto->getName().empty())
+        llctx.FunctionProtos[fn->proto->getName()] = fn->proto.get();
+  }
+
+  auto program =
+      std::make_unique<llvm::Module>("whole-program", *llctx.Context);
+  if (tm)
+    target::configureModule(*program, *tm);
+  llvm::Linker linker(*program);
+
+  std::set<std::string> keep(entryPoints.begin(), entryPoints.end());
+  for (size_t i = 0; i < units.size(); ++i) {
+    startModule(llctx, units[i]->name);
+    if (!units[i]->codegen(&llctx))
+      return nullptr;
+
+    // Top-level expressions stay reachable, under names unique to their file
+    unsigned anonymous = 0;
+    for (llvm::Function &f : *llctx.Module) {
+      if (f.isDeclaration() || !f.getName().starts_with(AnonExprName))
+        continue;
+      f.setName(std::format("{}.{}.{}", AnonExprName, i, anonymous++));
+      keep.insert(f.getName().str());
+    }
+
+    if (linker.linkInModule(std::move(llctx.Module))) {
+      ERROR("Could not link " << units[i]->name);
+      return nullptr;
+    }
+  }
+  llctx.Module = std::move(program);
+
+  for (auto &name : entryPoints)
+    if (!llctx.Module->getFunction(name))
+      WARN("Entry point " << name << " is not defined");
+
+  // Closed world: only the entry points are visible outside the program
+  llvm::internalizeModule(*llctx.Module, [&](const llvm::GlobalValue &gv) {
+    return keep.contains(gv.getName().str());
+  });
+  useFastCC(*llctx.Module);
+
+  // Interprocedural optimisation over the linked program: IPSCCP, argument
+  // promotion, inlining, GlobalOpt/GlobalDCE and the function simplification
+  // pipeline
+  llvm::ModulePassManager ipo = llctx.PB->buildLTODefaultPipeline(
+      llvm::OptimizationLevel::O3, nullptr);
+  ipo.run(*llctx.Module, *llctx.MAM);
+
+  DEBUG("*** Whole-program codegen ***");
+  if (log::enabled(log::debug) && log::currentLevel() == log::debug)
+    llctx.Module->print(log::Record(log::debug, false).stream(), nullptr);
+
+  return ctx;
 }
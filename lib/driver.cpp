@@ -0,0 +1,634 @@
+#include "driver.hpp"
+#include "ast/parser.hpp"
+#include "ast/passes.hpp"
+#include "ast/printer.hpp"
+#include "codegen.hpp"
+#include "constants.hpp"
+#include "jit.hpp"
+#include "lexer.hpp"
+#include "logger.hpp"
+#include "runner.hpp"
+#include "scheduler.hpp"
+#include "target.hpp"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SMLoc.h"
+#include "llvm/Support/SourceMgr.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <format>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <variant>
+
+std::unique_ptr<llvm::MemoryBuffer> driver::read_file(std::string filepath) {
+  using FileOrError = llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>;
+  FileOrError result = llvm::MemoryBuffer::getFileOrSTDIN(filepath);
+  if (!result) {
+    ERROR("Could not read " << filepath << ": " << result.getError().message());
+    return nullptr;
+  }
+  return std::move(result.get());
+}
+
+// The dump goes next to the object file when one is written (which keeps
+// concurrent batch compiles apart) and to stdout otherwise
+static bool dumpAst(const ast::CompilationUnit &cu,
+                    const std::string &outputPath) {
+  if (outputPath.empty()) {
+    log::flush();
+    ast::print(llvm::outs(), cu, DumpAst);
+    llvm::outs().flush();
+    return true;
+  }
+
+  llvm::SmallString<256> path(outputPath);
+  llvm::sys::path::replace_extension(path, "ast");
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    ERROR("Could not open " << path << ": " << ec.message());
+    return false;
+  }
+  ast::print(out, cu, DumpAst);
+  return true;
+}
+
+// The library goes to `path` and its header next to it
+static bool emitSharedLibrary(const ast::CompilationUnit &cu,
+                              llvm::Module &module, llvm::TargetMachine &tm,
+                              const std::string &path) {
+  if (!target::emitSharedLibrary(module, tm, path))
+    return false;
+
+  llvm::SmallString<256> headerPath(path);
+  llvm::sys::path::replace_extension(headerPath, "h");
+  std::error_code ec;
+  llvm::raw_fd_ostream header(headerPath, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    ERROR("Could not open " << headerPath << ": " << ec.message());
+    return false;
+  }
+  ast::printCHeader(header, cu, headerPath);
+  return true;
+}
+
+static bool writeOptReport(const codegen::LLVMCodegenCtx &llctx) {
+  if (!llctx.Report)
+    return true;
+  std::error_code ec;
+  llvm::raw_fd_ostream out(OptReport, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    ERROR("Could not open " << OptReport << ": " << ec.message());
+    return false;
+  }
+  llctx.Report->write(out);
+  return true;
+}
+
+// With -prune-unreachable, drop the definitions that neither top-level
+// expressions nor `roots` and the -entry functions can reach
+static void pruneUnreachable(const std::vector<ast::CompilationUnit *> &units,
+                             std::vector<std::string> roots) {
+  if (!PruneUnreachable)
+    return;
+  roots.insert(roots.end(), EntryPoints.begin(), EntryPoints.end());
+  ast::pruneUnreachable(units, roots);
+}
+
+// Fold and specialise a parsed unit, once pruning has dropped what it can
+static void simplify(ast::CompilationUnit &ast) {
+  ast::foldConstants(ast);
+  if (Specialise)
+    ast::specialiseCalls(ast, Specialise);
+  DEBUG("*** AST ***");
+  if (log::enabled(log::debug))
+    ast::print(log::Record(log::debug, false).stream(), ast);
+}
+
+// Lex, parse, prune and fold one buffer; nullptr (after logging) on error.
+// `roots` are the functions called from outside besides the -entry ones.
+static std::unique_ptr<ast::CompilationUnit>
+frontend(const llvm::MemoryBuffer *buf, const std::string &filename,
+         std::vector<std::string> roots = {}) {
+  auto ast = parser::parseBuffer(buf, filename, HashCons);
+  if (!ast)
+    return nullptr;
+  pruneUnreachable({ast.get()}, std::move(roots));
+  simplify(*ast);
+  return ast;
+}
+
+int driver::compile(const llvm::MemoryBuffer *buf, std::string filename,
+                    const codegen::Options &options,
+                    const std::string &outputPath) {
+  auto ast = frontend(buf, filename);
+  if (!ast)
+    return 1;
+
+  if (DumpAst.getNumOccurrences() > 0 && !dumpAst(*ast, outputPath))
+    return 1;
+
+  // Codegen
+  auto tm = target::createTargetMachine(options);
+  if (!tm)
+    return 1;
+
+  auto llctx = codegen::codegen(ast.get(), options, tm.get());
+  if (!llctx || !writeOptReport(*llctx))
+    return 1;
+
+  // Emit
+  if (outputPath.empty())
+    return 0;
+  if (Shared)
+    return emitSharedLibrary(*ast, *llctx->Module, *tm, outputPath) ? 0 : 1;
+  return target::emitObject(*llctx->Module, *tm, outputPath) ? 0 : 1;
+}
+
+int driver::compileFile(const std::string &filename,
+                        const codegen::Options &options,
+                        const std::string &outputPath) {
+  auto buffer = read_file(filename);
+  if (!buffer)
+    return 1;
+
+  llvm::SourceMgr source_manager;
+  auto id = source_manager.AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
+  const llvm::MemoryBuffer *buf = source_manager.getMemoryBuffer(id);
+  return compile(buf, filename, options, outputPath);
+}
+
+int driver::compilePipelined(const std::string &filename,
+                             const codegen::Options &options,
+                             const std::string &outputPath) {
+  // Tokens travel in chunks to keep queue traffic off the per-token path
+  constexpr size_t TokensPerChunk = 512;
+  constexpr size_t QueueDepth = 16;
+
+  auto buffer = read_file(filename);
+  if (!buffer)
+    return 1;
+  if (DumpAst.getNumOccurrences() > 0)
+    WARN("-dump-ast is ignored with -pipeline");
+  if (PruneUnreachable)
+    WARN("-prune-unreachable is ignored with -pipeline");
+
+  auto tm = target::createTargetMachine(options);
+  if (!tm)
+    return 1;
+  auto llctx = codegen::createContext(filename, options, tm.get());
+
+  scheduler::BoundedQueue<std::deque<Token>> tokenChunks(QueueDepth);
+  scheduler::BoundedQueue<parser::TopLevel> definitions(QueueDepth);
+  std::optional<std::string> lexerError;
+  std::atomic<bool> failed = false;
+
+  std::thread lexing([&] {
+    Lexer lexer(buffer.get());
+    std::deque<Token> chunk;
+    bool open = true;
+    while (auto token = lexer.next()) {
+      chunk.push_back(std::move(*token));
+      if (chunk.size() == TokensPerChunk &&
+          !(open = tokenChunks.push(std::exchange(chunk, {}))))
+        break;
+    }
+    if (open && !chunk.empty())
+      tokenChunks.push(std::move(chunk));
+    lexerError = lexer.error();
+    tokenChunks.close();
+  });
+
+  std::thread parsing([&] {
+    parser::TokenStream tokens([&](std::deque<Token> &out) {
+      auto chunk = tokenChunks.pop();
+      if (!chunk)
+        return false;
+      std::move(chunk->begin(), chunk->end(), std::back_inserter(out));
+      return true;
+    });
+
+    while (!tokens.empty()) {
+      auto node = parser::parseTopLevel(tokens);
+      if (!node) {
+        failed = true;
+        break;
+      }
+      if (auto *fn = std::get_if<std::unique_ptr<ast::FunctionDefinition>>(
+              &*node))
+        ast::foldConstants(**fn);
+      if (!definitions.push(std::move(*node)))
+        break;
+    }
+    // Stop the lexer early if parsing gave up
+    tokenChunks.close();
+    definitions.close();
+  });
+
+  // Externs are tiny and referenced by the codegen context until the end
+  std::vector<std::unique_ptr<ast::FunctionPrototype>> externs;
+
+  DEBUG("*** Starting pipelined codegen ***");
+  while (auto node = definitions.pop()) {
+    if (auto *proto =
+            std::get_if<std::unique_ptr<ast::FunctionPrototype>>(&*node)) {
+      codegen::declareExtern(llctx.get(), proto->get());
+      externs.push_back(std::move(*proto));
+      continue;
+    }
+
+    auto &fn = std::get<std::unique_ptr<ast::FunctionDefinition>>(*node);
+    llvm::Function *fnIR = fn->codegen(llctx.get());
+    if (!fnIR) {
+      failed = true;
+      break;
+    }
+    llctx->FPM->run(*fnIR, *llctx->FAM);
+  }
+  // Stop the parser early if codegen gave up
+  definitions.close();
+
+  parsing.join();
+  lexing.join();
+
+  if (lexerError) {
+    ERROR("Lexer error: " << *lexerError);
+    return 1;
+  }
+  if (failed)
+    return 1;
+
+  codegen::finishModule(*llctx);
+  llctx->MPM->run(*llctx->Module, *llctx->MAM);
+  DEBUG("*** Optimised codegen ***");
+  if (log::enabled(log::debug) && log::currentLevel() == log::debug)
+    llctx->Module->print(log::Record(log::debug, false).stream(), nullptr);
+  if (!writeOptReport(*llctx))
+    return 1;
+
+  if (!outputPath.empty() &&
+      !target::emitObject(*llctx->Module, *tm, outputPath))
+    return 1;
+
+  return 0;
+}
+
+int driver::repl(const codegen::Options &options) {
+  codegen::Options jitOptions = options;
+  if (jitOptions.OptReport) {
+    WARN("-opt-report is ignored in the REPL");
+    jitOptions.OptReport = false;
+  }
+  auto jit = jit::KaleidoscopeJIT::create(jitOptions);
+  if (!jit)
+    return 1;
+
+  std::string line;
+  while (true) {
+    log::flush();
+    llvm::errs() << "ready> ";
+    if (!std::getline(std::cin, line))
+      break;
+
+    auto buf = llvm::MemoryBuffer::getMemBuffer(line, "<stdin>");
+    Lexer lexer(buf.get());
+    parser::TokenStream tokens([&](std::deque<Token> &out) {
+      auto token = lexer.next();
+      if (!token)
+        return false;
+      out.push_back(std::move(*token));
+      return true;
+    });
+
+    while (!tokens.empty()) {
+      auto node = parser::parseTopLevel(tokens);
+      if (!node)
+        break;
+      if (auto *proto =
+              std::get_if<std::unique_ptr<ast::FunctionPrototype>>(&*node)) {
+        jit->addExtern(std::move(*proto));
+        continue;
+      }
+
+      auto fn =
+          std::move(std::get<std::unique_ptr<ast::FunctionDefinition>>(*node));
+      ast::foldConstants(*fn);
+      if (!fn->proto->getName().empty()) {
+        jit->addDefinition(std::move(fn));
+        continue;
+      }
+      if (auto result = jit->evaluate(std::move(fn))) {
+        log::flush();
+        llvm::outs() << std::format("{}\n", *result);
+        llvm::outs().flush();
+      }
+    }
+    if (lexer.error())
+      ERROR("Lexer error: " << *lexer.error());
+  }
+
+  llvm::errs() << '\n';
+  log::flush();
+  return 0;
+}
+
+std::vector<std::string> driver::readManifest(const std::string &path) {
+  std::vector<std::string> inputs;
+  auto buffer = read_file(path);
+  if (!buffer)
+    return inputs;
+
+  llvm::SmallVector<llvm::StringRef> lines;
+  buffer->getBuffer().split(lines, '\n', -1, false);
+  for (llvm::StringRef line : lines) {
+    line = line.trim();
+    if (line.empty() || line.starts_with("#"))
+      continue;
+    inputs.push_back(line.str());
+  }
+  return inputs;
+}
+
+static std::string objectPathFor(const std::string &input,
+                                 const std::string &outputDir) {
+  llvm::SmallString<256> path;
+  if (outputDir.empty()) {
+    path = input;
+  } else {
+    path = outputDir;
+    llvm::sys::path::append(path, llvm::sys::path::filename(input));
+  }
+  llvm::sys::path::replace_extension(path, Shared ? "so" : "o");
+  return std::string(path);
+}
+
+int driver::compileBatch(const std::vector<std::string> &inputs,
+                         const BatchOptions &options) {
+  using Clock = std::chrono::steady_clock;
+
+  struct FileResult {
+    int status = 1;
+    double seconds = 0;
+  };
+  std::vector<FileResult> results(inputs.size());
+
+  // Files would overwrite each other's report
+  codegen::Options codegenOptions = options.codegen;
+  if (codegenOptions.OptReport) {
+    WARN("-opt-report is ignored when compiling several files");
+    codegenOptions.OptReport = false;
+  }
+
+  if (!options.outputDir.empty()) {
+    if (std::error_code ec =
+            llvm::sys::fs::create_directories(options.outputDir)) {
+      ERROR("Could not create output directory " << options.outputDir << ": "
+                                                 << ec.message());
+      return 1;
+    }
+  }
+
+  auto start = Clock::now();
+  {
+    // Tasks only carry a path; a source is read when its task starts, so at
+    // most one file per worker is held in memory at any time.
+    scheduler::WorkStealingPool pool(options.jobs);
+    INFO(std::format("Compiling {} files on {} threads", inputs.size(),
+                     pool.size()));
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      pool.submit([&, i] {
+        auto fileStart = Clock::now();
+        results[i].status =
+            compileFile(inputs[i], codegenOptions,
+                        objectPathFor(inputs[i], options.outputDir));
+        results[i].seconds =
+            std::chrono::duration<double>(Clock::now() - fileStart).count();
+
+        if (results[i].status != 0) {
+          ERROR("Failed to compile " << inputs[i]);
+        } else {
+          DEBUG("Compiled" << log::kv("file", inputs[i])
+                           << log::kv("seconds", results[i].seconds));
+        }
+      });
+    }
+    pool.wait();
+  }
+  double total = std::chrono::duration<double>(Clock::now() - start).count();
+
+  size_t failed = 0;
+  for (auto &result : results)
+    if (result.status != 0)
+      ++failed;
+
+  // Failures are always reported, a clean build only as information
+  log::LoggingLevel level = failed > 0 ? log::error : log::info;
+  if (log::enabled(level)) {
+    log::Record summary(level, false);
+    summary << std::format("{} of {} files compiled in {:.3f}s",
+                           inputs.size() - failed, inputs.size(), total);
+    if (failed > 0) {
+      summary << std::format(", {} failed:", failed);
+      for (size_t i = 0; i < inputs.size(); ++i)
+        if (results[i].status != 0)
+          summary << "\n  " << inputs[i];
+    }
+  }
+
+  return failed > 0 ? 1 : 0;
+}
+
+int driver::compileWholeProgram(const std::vector<std::string> &inputs,
+                                const std::vector<std::string> &entryPoints,
+                                const codegen::Options &options,
+                                const std::string &outputPath) {
+  // Token locations point into the buffers, so they live as long as the ASTs
+  llvm::SourceMgr source_manager;
+  std::vector<std::unique_ptr<ast::CompilationUnit>> asts;
+  for (auto &input : inputs) {
+    auto buffer = read_file(input);
+    if (!buffer)
+      return 1;
+    auto id =
+        source_manager.AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
+    auto ast = parser::parseBuffer(source_manager.getMemoryBuffer(id), input,
+                                   HashCons);
+    if (!ast)
+      return 1;
+    asts.push_back(std::move(ast));
+  }
+
+  std::vector<ast::CompilationUnit *> units;
+  for (auto &ast : asts)
+    units.push_back(ast.get());
+  // Calls cross files, so reachability is computed over the whole program,
+  // and only then are the surviving definitions folded and specialised
+  pruneUnreachable(units, entryPoints);
+  for (auto *unit : units)
+    simplify(*unit);
+
+  auto tm = target::createTargetMachine(options);
+  if (!tm)
+    return 1;
+
+  auto llctx = codegen::codegenWholeProgram(units, entryPoints, options,
+                                            tm.get());
+  if (!llctx || !writeOptReport(*llctx))
+    return 1;
+
+  return target::emitObject(*llctx->Module, *tm, outputPath) ? 0 : 1;
+}
+
+int driver::run(const std::string &filename, const std::string &function,
+                const std::vector<std::string> &columns,
+                const std::string &outputPath, uint64_t rows, unsigned jobs,
+                const codegen::Options &options) {
+  auto buffer = read_file(filename);
+  if (!buffer)
+    return 1;
+  auto ast = frontend(buffer.get(), filename, std::vector{function});
+  if (!ast)
+    return 1;
+
+  auto tm = target::createTargetMachine(options);
+  if (!tm)
+    return 1;
+  auto llctx = codegen::codegen(ast.get(), options, tm.get());
+  if (!llctx)
+    return 1;
+
+  llvm::Function *f = llctx->Module->getFunction(function);
+  if (!f || f->isDeclaration()) {
+    ERROR("Function " << function << " is not defined in " << filename);
+    return 1;
+  }
+  llvm::Type *dbl = llvm::Type::getDoubleTy(f->getContext());
+  if (f->getReturnType() != dbl ||
+      llvm::any_of(f->args(),
+                   [&](auto &arg) { return arg.getType() != dbl; })) {
+    ERROR("Function " << function
+                      << " passes vectors; -run evaluates doubles only");
+    return 1;
+  }
+  if (f->arg_size() != columns.size()) {
+    ERROR("Function " << function << " takes " << f->arg_size()
+                      << " arguments, but " << columns.size()
+                      << " columns were given");
+    return 1;
+  }
+  if (columns.empty() && rows == 0) {
+    ERROR("Function " << function
+                      << " takes no arguments, so -rows must say how many "
+                         "results to write");
+    return 1;
+  }
+  if (!columns.empty() && rows != 0) {
+    ERROR("-rows is only for functions without arguments; "
+          << function << " takes its row count from the columns");
+    return 1;
+  }
+
+  // Inline the function into its batch loop and vectorise that
+  codegen::addBatchEntry(*llctx, *f);
+  llctx->PB->buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3)
+      .run(*llctx->Module, *llctx->MAM);
+  // The O3 run is where inlining and vectorisation happen, so the report
+  // covers it too
+  if (!writeOptReport(*llctx))
+    return 1;
+
+  auto lljit = jit::createLLJIT(*tm, options);
+  if (!lljit)
+    return 1;
+  if (!jit::check(lljit->addIRModule(jit::takeModule(*llctx, filename))))
+    return 1;
+  auto entry = lljit->lookup(function + codegen::BatchSuffix);
+  if (!entry) {
+    jit::check(entry.takeError());
+    return 1;
+  }
+
+  return runner::evaluate(entry->toPtr<codegen::BatchEntry *>(), columns,
+                          outputPath, rows, jobs)
+             ? 0
+             : 1;
+}
+
+int driver::evaluate(const std::string &filename, unsigned jobs,
+                     const codegen::Options &options) {
+  auto buffer = read_file(filename);
+  if (!buffer)
+    return 1;
+  auto ast = frontend(buffer.get(), filename);
+  if (!ast)
+    return 1;
+
+  // Give each expression a name to look it up by
+  std::vector<std::string> expressions;
+  for (auto &fn : ast->functions)
+    if (fn->proto->getName().empty())
+      fn->proto->name = expressions.emplace_back(
+          std::format("{}.{}", codegen::AnonExprName, expressions.size()));
+
+  auto tm = target::createTargetMachine(options);
+  if (!tm)
+    return 1;
+  auto llctx = codegen::codegen(ast.get(), options, tm.get());
+  if (!llctx || !writeOptReport(*llctx))
+    return 1;
+
+  std::unique_ptr<llvm::orc::LLJIT> lljit;
+  // lljit itself when functions are compiled on their first call
+  llvm::orc::LLLazyJIT *lazyjit = nullptr;
+  if (options.SpeculativeThreads) {
+    auto lazy = jit::createSpeculativeJIT(*tm, options);
+    lazyjit = lazy.get();
+    lljit = std::move(lazy);
+  } else {
+    lljit = jit::createLLJIT(*tm, options);
+  }
+  if (!lljit)
+    return 1;
+  auto module = jit::takeModule(*llctx, filename);
+  if (!jit::check(lazyjit ? lazyjit->addLazyIRModule(std::move(module))
+                          : lljit->addIRModule(std::move(module))))
+    return 1;
+
+  // Compile everything up front so the workers only run code. A lazy JIT
+  // only hands out stubs here, and the workers' first calls compile.
+  std::vector<double (*)()> entries;
+  for (const std::string &name : expressions) {
+    auto entry = lljit->lookup(name);
+    if (!entry) {
+      jit::check(entry.takeError());
+      return 1;
+    }
+    entries.push_back(entry->toPtr<double (*)()>());
+  }
+
+  scheduler::WorkStealingPool pool(jobs);
+  std::vector<double> results(entries.size());
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < entries.size(); ++i)
+    pool.submit([&results, &entries, i] { results[i] = entries[i](); });
+  pool.wait();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  INFO(std::format("Evaluated {} expressions in {:.3f}s on {} threads",
+                   entries.size(), seconds, pool.size()));
+
+  log::flush();
+  for (double result : results)
+    llvm::outs() << std::format("{}\n", result);
+  llvm::outs().flush();
+  return 0;
+}
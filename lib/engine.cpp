@@ -0,0 +1,143 @@
+#include "engine.hpp"
+#include "ast/parser.hpp"
+#include "ast/passes.hpp"
+#include "ast/printer.hpp"
+#include "jit.hpp"
+#include "logger.hpp"
+#include "target.hpp"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+// Parse and fold `source`, keeping only the named functions; nullptr (after
+// logging) on error
+static std::unique_ptr<ast::CompilationUnit> frontend(std::string_view source,
+                                                      const std::string &name) {
+  // The lexer relies on the terminating null of a copied buffer
+  auto buffer = llvm::MemoryBuffer::getMemBufferCopy(source, name);
+  auto ast = parser::parseBuffer(buffer.get(), name);
+  if (!ast)
+    return nullptr;
+  ast::foldConstants(*ast);
+
+  size_t before = ast->functions.size();
+  std::erase_if(ast->functions,
+                [](auto &fn) { return fn->proto->getName().empty(); });
+  if (ast->functions.size() != before)
+    WARN("Ignoring top-level expressions in " << name);
+  return ast;
+}
+
+std::unique_ptr<kaleidoscope::Engine>
+kaleidoscope::Engine::create(const codegen::Options &options) {
+  target::initialise();
+  auto tm = target::createTargetMachine(options);
+  if (!tm)
+    return nullptr;
+
+  auto engine = std::unique_ptr<Engine>(new Engine());
+  if (options.SpeculativeThreads) {
+    auto lazyjit = jit::createSpeculativeJIT(*tm, options);
+    engine->lazyjit = lazyjit.get();
+    engine->lljit = std::move(lazyjit);
+  } else {
+    engine->lljit = jit::createLLJIT(*tm, options);
+  }
+  if (!engine->lljit)
+    return nullptr;
+
+  engine->options = options;
+  engine->tm = std::move(tm);
+  return engine;
+}
+
+std::optional<kaleidoscope::Engine::ModuleHandle>
+kaleidoscope::Engine::compile(std::string_view source,
+                              const std::string &name) {
+  auto ast = frontend(source, name);
+  if (!ast)
+    return std::nullopt;
+
+  // Each module has a context of its own, so compiles run in parallel
+  auto llctx = codegen::codegen(ast.get(), options, tm.get());
+  if (!llctx)
+    return std::nullopt;
+  // Taken before it is added: with a lazy JIT, speculative compile threads
+  // may start on the module as soon as addLazyIRModule returns
+  auto module = jit::takeModule(*llctx, name);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto tracker = lljit->getMainJITDylib().createResourceTracker();
+  if (!jit::check(lazyjit
+                      ? lazyjit->addLazyIRModule(tracker, std::move(module))
+                      : lljit->addIRModule(tracker, std::move(module)))) {
+    jit::check(tracker->remove());
+    return std::nullopt;
+  }
+
+  ModuleHandle handle = nextHandle++;
+  modules[handle] = std::move(tracker);
+  for (auto &fn : ast->functions)
+    if (fn->proto->usesVectors())
+      vectorFunctions[fn->proto->getName()] = handle;
+  return handle;
+}
+
+void *kaleidoscope::Engine::lookup(const std::string &name) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (vectorFunctions.contains(name)) {
+      ERROR("Function " << name << " passes vectors, so it cannot be called "
+                                   "as double(double, ...)");
+      return nullptr;
+    }
+  }
+
+  auto symbol = lljit->lookup(name);
+  if (!symbol) {
+    jit::check(symbol.takeError());
+    return nullptr;
+  }
+  return symbol->toPtr<void *>();
+}
+
+bool kaleidoscope::Engine::release(ModuleHandle module) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto entry = modules.find(module);
+  if (entry == modules.end()) {
+    ERROR("Unknown module " << module);
+    return false;
+  }
+  auto tracker = std::move(entry->second);
+  modules.erase(entry);
+  std::erase_if(vectorFunctions,
+                [&](auto &function) { return function.second == module; });
+  return jit::check(tracker->remove());
+}
+
+bool kaleidoscope::Engine::emitSharedLibrary(std::string_view source,
+                                             const std::string &libraryPath,
+                                             const std::string &headerPath) {
+  auto ast = frontend(source, libraryPath);
+  if (!ast)
+    return false;
+
+  auto llctx = codegen::codegen(ast.get(), options, tm.get());
+  if (!llctx)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!target::emitSharedLibrary(*llctx->Module, *tm, libraryPath))
+      return false;
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream header(headerPath, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    ERROR("Could not open " << headerPath << ": " << ec.message());
+    return false;
+  }
+  ast::printCHeader(header, *ast, headerPath);
+  return true;
+}
@@ -0,0 +1,534 @@
+#include "jit.hpp"
+#include "logger.hpp"
+#include "target.hpp"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRPartitionLayer.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/Speculation.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include <format>
+#include <mutex>
+
+bool jit::check(llvm::Error err) {
+  if (!err)
+    return true;
+  ERROR("JIT: " << llvm::toString(std::move(err)));
+  return false;
+}
+
+llvm::orc::ThreadSafeModule jit::takeModule(codegen::LLVMCodegenCtx &llctx,
+                                            const std::string &next) {
+  llvm::orc::ThreadSafeModule module(
+      std::move(llctx.Module),
+      llvm::orc::ThreadSafeContext(std::move(llctx.Context)));
+  codegen::resetContext(llctx, next);
+  return module;
+}
+
+namespace {
+
+// Appends the functions of every loaded object to /tmp/perf-<pid>.map, the
+// symbol map perf reads for code it finds no binary for
+class PerfMapListener : public llvm::JITEventListener {
+public:
+  static PerfMapListener *get() {
+    static PerfMapListener listener;
+    return listener.map ? &listener : nullptr;
+  }
+
+  void notifyObjectLoaded(
+      ObjectKey, const llvm::object::ObjectFile &obj,
+      const llvm::RuntimeDyld::LoadedObjectInfo &info) override {
+    auto debugObj = info.getObjectForDebug(obj);
+    const llvm::object::ObjectFile &loaded =
+        debugObj.getBinary() ? *debugObj.getBinary() : obj;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto [symbol, size] : llvm::object::computeSymbolSizes(loaded)) {
+      auto type = symbol.getType();
+      if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+        llvm::consumeError(type.takeError());
+        continue;
+      }
+      auto name = symbol.getName();
+      auto address = symbol.getAddress();
+      if (!name || !address || !size) {
+        llvm::consumeError(name.takeError());
+        llvm::consumeError(address.takeError());
+        continue;
+      }
+      *map << std::format("{:x} {:x} {}\n", *address, size, name->str());
+    }
+    map->flush();
+  }
+
+private:
+  std::mutex mutex;
+  std::unique_ptr<llvm::raw_fd_ostream> map;
+
+  PerfMapListener() {
+    std::string path = std::format("/tmp/perf-{}.map",
+                                   llvm::sys::Process::getProcessId());
+    std::error_code ec;
+    map = std::make_unique<llvm::raw_fd_ostream>(
+        path, ec, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+    if (ec) {
+      WARN("Could not open " << path << ": " << ec.message());
+      map.reset();
+    }
+  }
+};
+
+} // namespace
+
+// Build a JIT of any LLJIT flavour generating code for the machine's triple,
+// CPU and features, whose programs can call into the host process (e.g.
+// libm) and, as the options ask, are announced to perf
+template <typename JIT, typename Builder>
+static std::unique_ptr<JIT> build(Builder &builder,
+                                  const llvm::TargetMachine &tm,
+                                  const codegen::Options &options) {
+  // Compile for the same CPU and features the IR is annotated with
+  llvm::orc::JITTargetMachineBuilder jtmb(tm.getTargetTriple());
+  jtmb.setCPU(tm.getTargetCPU().str());
+  llvm::SmallVector<llvm::StringRef> features;
+  tm.getTargetFeatureString().split(features, ',', -1, false);
+  std::vector<std::string> featureList;
+  for (llvm::StringRef feature : features)
+    featureList.push_back(feature.str());
+  jtmb.addFeatures(featureList);
+  jtmb.setOptions(tm.Options);
+  builder.setJITTargetMachineBuilder(std::move(jtmb));
+
+  // Profilers learn about JIT-compiled code through event listeners, which
+  // only the RuntimeDyld linking layer notifies
+  std::vector<llvm::JITEventListener *> listeners;
+  if (options.PerfJITDump) {
+    if (auto *listener = llvm::JITEventListener::createPerfJITEventListener())
+      listeners.push_back(listener);
+    else
+      WARN("This LLVM was built without perf jitdump support");
+  }
+  if (options.PerfMap)
+    if (auto *listener = PerfMapListener::get())
+      listeners.push_back(listener);
+  if (!listeners.empty())
+    builder.setObjectLinkingLayerCreator(
+        [listeners](llvm::orc::ExecutionSession &es, const llvm::Triple &)
+            -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>> {
+          auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+              es, [](const llvm::MemoryBuffer &) {
+                return std::make_unique<llvm::SectionMemoryManager>();
+              });
+          for (auto *listener : listeners)
+            layer->registerJITEventListener(*listener);
+          return layer;
+        });
+
+  auto lljit = builder.create();
+  if (!lljit) {
+    jit::check(lljit.takeError());
+    return nullptr;
+  }
+
+  // Let programs call into the host process, e.g. libm
+  auto generator =
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          (*lljit)->getDataLayout().getGlobalPrefix());
+  if (!generator) {
+    jit::check(generator.takeError());
+    return nullptr;
+  }
+  (*lljit)->getMainJITDylib().addGenerator(std::move(*generator));
+  return std::move(*lljit);
+}
+
+std::unique_ptr<llvm::orc::LLJIT>
+jit::createLLJIT(const llvm::TargetMachine &tm,
+                 const codegen::Options &options) {
+  llvm::orc::LLJITBuilder builder;
+  return build<llvm::orc::LLJIT>(builder, tm, options);
+}
+
+namespace {
+
+// Compiles the functions a function calls as soon as that function is
+// compiled, so they are ready, or at least under way, by the time it calls
+// them. Runs as the IR transform of a lazy JIT, which sees each function
+// when it is first requested; the lookups it issues are served by the JIT's
+// compile threads while the requesting thread carries on.
+class CalleeSpeculator
+    : public std::enable_shared_from_this<CalleeSpeculator> {
+public:
+  explicit CalleeSpeculator(llvm::orc::LLLazyJIT &jit)
+      : jit(jit), impls(&jit.getExecutionSession()) {}
+
+  // Filled in by the compile-on-demand layer: the body behind each stub
+  llvm::orc::ImplSymbolMap impls;
+
+  llvm::Expected<llvm::orc::ThreadSafeModule>
+  operator()(llvm::orc::ThreadSafeModule tsm,
+             llvm::orc::MaterializationResponsibility &r) {
+    llvm::orc::SymbolLookupSet callees;
+    tsm.withModuleDo([&](llvm::Module &module) {
+      for (llvm::Function &f : module) {
+        if (f.isDeclaration())
+          continue;
+        for (llvm::BasicBlock &bb : f)
+          for (llvm::Instruction &inst : bb)
+            if (auto *call = llvm::dyn_cast<llvm::CallInst>(&inst))
+              if (llvm::Function *callee = call->getCalledFunction();
+                  callee && callee->isDeclaration() && !callee->isIntrinsic())
+                callees.add(jit.mangleAndIntern(callee->getName()),
+                            llvm::orc::SymbolLookupFlags::
+                                WeaklyReferencedSymbol);
+      }
+    });
+    callees.removeDuplicates();
+    if (!callees.empty())
+      speculate(r.getTargetJITDylib(), std::move(callees));
+    return std::move(tsm);
+  }
+
+private:
+  llvm::orc::LLLazyJIT &jit;
+
+  // Resolve the callees' stubs first, which records the bodies behind them,
+  // then look the bodies up, which compiles them
+  void speculate(llvm::orc::JITDylib &jd, llvm::orc::SymbolLookupSet stubs) {
+    auto &es = jit.getExecutionSession();
+    auto ignore = [](llvm::Expected<llvm::orc::SymbolMap> result) {
+      // A real call reports whatever went wrong here
+      if (!result)
+        DEBUG("Speculation failed: " << llvm::toString(result.takeError()));
+    };
+    es.lookup(
+        llvm::orc::LookupKind::Static, llvm::orc::makeJITDylibSearchOrder(&jd),
+        std::move(stubs), llvm::orc::SymbolState::Ready,
+        [self = shared_from_this(),
+         ignore](llvm::Expected<llvm::orc::SymbolMap> resolved) {
+          if (!resolved)
+            return ignore(std::move(resolved));
+          for (auto &[stub, address] : *resolved) {
+            auto impl = self->impls.getImplFor(stub);
+            if (!impl)
+              continue;
+            self->jit.getExecutionSession().lookup(
+                llvm::orc::LookupKind::Static,
+                llvm::orc::makeJITDylibSearchOrder(impl->second),
+                llvm::orc::SymbolLookupSet(impl->first),
+                llvm::orc::SymbolState::Ready, ignore,
+                llvm::orc::NoDependenciesToRegister);
+          }
+        },
+        llvm::orc::NoDependenciesToRegister);
+  }
+};
+
+} // namespace
+
+std::unique_ptr<llvm::orc::LLLazyJIT>
+jit::createSpeculativeJIT(const llvm::TargetMachine &tm,
+                          const codegen::Options &options) {
+  llvm::orc::LLLazyJITBuilder builder;
+  builder.setNumCompileThreads(options.SpeculativeThreads);
+  auto lljit = build<llvm::orc::LLLazyJIT>(builder, tm, options);
+  if (!lljit)
+    return nullptr;
+
+  // One function per compile, so a call compiles no more than it needs.
+  // Partitioning is done by the IRPartitionLayer in front of the
+  // compile-on-demand layer, which only emits the stubs and bodies.
+  lljit->setPartitionFunction(llvm::orc::IRPartitionLayer::compileRequested);
+  auto speculator = std::make_shared<CalleeSpeculator>(*lljit);
+  lljit->getCompileOnDemandLayer().setImplMap(&speculator->impls);
+  lljit->getIRTransformLayer().setTransform(
+      [speculator](llvm::orc::ThreadSafeModule tsm,
+                   llvm::orc::MaterializationResponsibility &r) {
+        return (*speculator)(std::move(tsm), r);
+      });
+  return lljit;
+}
+
+std::unique_ptr<jit::KaleidoscopeJIT>
+jit::KaleidoscopeJIT::create(const codegen::Options &options) {
+  auto tm = target::createTargetMachine(options);
+  if (!tm)
+    return nullptr;
+
+  auto lljit = createLLJIT(*tm, options);
+  if (!lljit)
+    return nullptr;
+
+  auto stubsBuilder =
+      llvm::orc::createLocalIndirectStubsManagerBuilder(tm->getTargetTriple());
+  if (!stubsBuilder) {
+    ERROR("JIT: no indirect stubs for " << tm->getTargetTriple().str());
+    return nullptr;
+  }
+
+  auto jit = std::unique_ptr<KaleidoscopeJIT>(new KaleidoscopeJIT());
+  jit->llctx = codegen::createContext("repl.0", options, tm.get());
+  jit->tm = std::move(tm);
+  jit->lljit = std::move(lljit);
+  jit->stubs = stubsBuilder();
+  if (options.TierUpCalls) {
+    jit->optctx = codegen::createContext("tier-up.0", options, jit->tm.get());
+    jit->optimiser = std::thread([jit = jit.get()] { jit->optimise(); });
+  }
+  return jit;
+}
+
+jit::KaleidoscopeJIT::~KaleidoscopeJIT() {
+  // Requests still queued are dropped
+  hot.close();
+  if (optimiser.joinable())
+    optimiser.join();
+}
+
+// Count calls to `f` in `calls` and pass `tier` to requestTierUp on the call
+// that reaches `threshold`
+static void countCalls(llvm::Function &f, std::atomic<uint64_t> *calls,
+                       void *tier, uint64_t threshold,
+                       void (*requestTierUp)(void *)) {
+  // The generated code treats the counter as a plain i64
+  static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                sizeof(std::atomic<uint64_t>) == sizeof(uint64_t));
+  // An otherwise pure function now writes the counter and may call out to
+  // request the tier-up
+  f.setMemoryEffects(llvm::MemoryEffects::unknown());
+  f.removeFnAttr(llvm::Attribute::NoUnwind);
+  llvm::BasicBlock &entry = f.getEntryBlock();
+  llvm::IRBuilder<> builder(&entry, entry.getFirstInsertionPt());
+  auto address = [&](const void *p) {
+    return builder.CreateIntToPtr(
+        builder.getInt64(reinterpret_cast<uintptr_t>(p)), builder.getPtrTy());
+  };
+
+  llvm::Value *count = builder.CreateAtomicRMW(
+      llvm::AtomicRMWInst::Add, address(calls), builder.getInt64(1),
+      llvm::Align(alignof(std::atomic<uint64_t>)),
+      llvm::AtomicOrdering::Monotonic);
+  llvm::Value *hot =
+      builder.CreateICmpEQ(count, builder.getInt64(threshold - 1));
+  llvm::Instruction *then = llvm::SplitBlockAndInsertIfThen(
+      hot, builder.GetInsertPoint(), false,
+      llvm::MDBuilder(f.getContext()).createBranchWeights(1, 1 << 20));
+
+  builder.SetInsertPoint(then);
+  auto *type = llvm::FunctionType::get(builder.getVoidTy(),
+                                       {builder.getPtrTy()}, false);
+  builder.CreateCall(type,
+                     address(reinterpret_cast<const void *>(requestTierUp)),
+                     {address(tier)});
+}
+
+llvm::Function *jit::KaleidoscopeJIT::generate(ast::FunctionDefinition &fn,
+                                               Tier *tier) {
+  llvm::Function *f = fn.codegen(llctx.get());
+  if (!f) {
+    // Drop whatever declarations the failed attempt left behind
+    codegen::resetContext(*llctx, std::format("repl.{}", ++inputs));
+    return nullptr;
+  }
+
+  if (tier)
+    countCalls(*f, &tier->calls, tier, llctx->Opts.TierUpCalls,
+               &requestTierUp);
+  llctx->FPM->run(*f, *llctx->FAM);
+  if (log::enabled(log::debug) && log::currentLevel() == log::debug)
+    f->print(log::Record(log::debug, false).stream());
+  return f;
+}
+
+bool jit::KaleidoscopeJIT::submit(llvm::orc::ResourceTrackerSP tracker) {
+  codegen::finishModule(*llctx);
+  auto module = takeModule(*llctx, std::format("repl.{}", ++inputs));
+  return check(lljit->addIRModule(std::move(tracker), std::move(module)));
+}
+
+bool jit::KaleidoscopeJIT::addDefinition(
+    std::unique_ptr<ast::FunctionDefinition> fn) {
+  const std::string name = fn->proto->getName();
+  const size_t arity = fn->proto->args.size();
+
+  // Callers compiled against the old stub keep passing the old arguments
+  auto previous = definitions.find(name);
+  if (previous != definitions.end() && previous->second.arity != arity) {
+    ERROR("Function " << name << " cannot be redefined with " << arity
+                      << " arguments instead of " << previous->second.arity);
+    return false;
+  }
+
+  std::unique_ptr<Tier> tier;
+  if (optimiser.joinable())
+    tier.reset(new Tier{.jit = this, .name = name, .input = inputs});
+  llvm::Function *f = generate(*fn, tier.get());
+  if (!f)
+    return false;
+
+  // The body gets a name of its own; everyone else calls it through the stub
+  const unsigned input = inputs;
+  std::string implName = std::format("{}.impl.{}", name, input);
+  f->setName(implName);
+
+  auto &jd = lljit->getMainJITDylib();
+  auto tracker = jd.createResourceTracker();
+  if (!submit(tracker))
+    return false;
+
+  auto impl = lljit->lookup(implName);
+  if (!impl) {
+    check(impl.takeError());
+    check(tracker->remove());
+    return false;
+  }
+
+  // Nothing refers to the new body until the stub points at it, so drop it
+  // if that cannot be arranged
+  auto discard = [&](llvm::Error err) {
+    check(std::move(err));
+    check(tracker->remove());
+    return false;
+  };
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (previous == definitions.end()) {
+    if (auto err = stubs->createStub(name, *impl,
+                                     llvm::JITSymbolFlags::Exported |
+                                         llvm::JITSymbolFlags::Callable))
+      return discard(std::move(err));
+    llvm::orc::SymbolMap stub;
+    stub[lljit->mangleAndIntern(name)] = stubs->findStub(name, false);
+    if (auto err = jd.define(llvm::orc::absoluteSymbols(std::move(stub))))
+      return discard(std::move(err));
+    previous = definitions.emplace(name, Definition{.arity = arity}).first;
+  } else {
+    if (auto err = stubs->updatePointer(name, *impl))
+      return discard(std::move(err));
+    check(previous->second.tracker->remove());
+    if (previous->second.optimised)
+      check(previous->second.optimised->remove());
+  }
+
+  Definition &definition = previous->second;
+  definition.tracker = tracker;
+  definition.optimised = nullptr;
+  definition.input = input;
+  definition.source = std::move(fn);
+  definition.tier = std::move(tier);
+
+  DEBUG("Defined" << log::kv("function", name) << log::kv("body", implName));
+  llctx->FunctionProtos[name] = definition.source->proto.get();
+  return true;
+}
+
+void jit::KaleidoscopeJIT::requestTierUp(void *counter) {
+  auto *tier = static_cast<Tier *>(counter);
+  DEBUG("Hot" << log::kv("function", tier->name)
+              << log::kv("calls", tier->calls.load()));
+  tier->jit->hot.push({tier->name, tier->input});
+}
+
+void jit::KaleidoscopeJIT::optimise() {
+  while (auto request = hot.pop())
+    tierUp(*request);
+}
+
+void jit::KaleidoscopeJIT::tierUp(const TierUpRequest &request) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto current = [&] {
+    auto definition = definitions.find(request.name);
+    return definition != definitions.end() &&
+           definition->second.input == request.input;
+  };
+  // Redefined since it was queued
+  if (!current())
+    return;
+
+  // Declare everything the main context knows about
+  optctx->FunctionProtos = llctx->FunctionProtos;
+  optctx->MathIntrinsics = llctx->MathIntrinsics;
+  llvm::Function *f =
+      definitions[request.name].source->codegen(optctx.get());
+  lock.unlock();
+  if (!f) {
+    codegen::resetContext(*optctx, optctx->Module->getName().str());
+    return;
+  }
+
+  std::string optName =
+      std::format("{}.opt.{}", request.name, request.input);
+  f->setName(optName);
+  codegen::finishModule(*optctx);
+  optctx->PB->buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3)
+      .run(*optctx->Module, *optctx->MAM);
+
+  llvm::orc::ThreadSafeModule module(
+      std::move(optctx->Module),
+      llvm::orc::ThreadSafeContext(std::move(optctx->Context)));
+  codegen::resetContext(*optctx, std::format("tier-up.{}", request.input));
+  auto tracker = lljit->getMainJITDylib().createResourceTracker();
+  if (!check(lljit->addIRModule(tracker, std::move(module))))
+    return;
+  auto body = lljit->lookup(optName);
+  if (!body) {
+    check(body.takeError());
+    check(tracker->remove());
+    return;
+  }
+
+  lock.lock();
+  if (!current() || !check(stubs->updatePointer(request.name, *body))) {
+    check(tracker->remove());
+    return;
+  }
+  definitions[request.name].optimised = tracker;
+  INFO("Tiered up" << log::kv("function", request.name)
+                   << log::kv("body", optName));
+}
+
+bool jit::KaleidoscopeJIT::addExtern(
+    std::unique_ptr<ast::FunctionPrototype> proto) {
+  const std::string name = proto->getName();
+  if (definitions.contains(name)) {
+    ERROR("Function " << name << " is already defined");
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  codegen::declareExtern(llctx.get(),
+                         (prototypes[name] = std::move(proto)).get());
+  return true;
+}
+
+std::optional<double>
+jit::KaleidoscopeJIT::evaluate(std::unique_ptr<ast::FunctionDefinition> expr) {
+  llvm::Function *f = generate(*expr);
+  if (!f)
+    return std::nullopt;
+  std::string name = f->getName().str();
+
+  auto tracker = lljit->getMainJITDylib().createResourceTracker();
+  if (!submit(tracker))
+    return std::nullopt;
+
+  auto entry = lljit->lookup(name);
+  if (!entry) {
+    check(entry.takeError());
+    check(tracker->remove());
+    return std::nullopt;
+  }
+
+  double result = entry->toPtr<double (*)()>()();
+  check(tracker->remove());
+  return result;
+}
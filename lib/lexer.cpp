@@ -4,28 +4,34 @@
 #include <cctype>
 #include <print>
 
-TokenizeResult tokenize(const llvm::MemoryBuffer *buffer) {
-  std::deque<Token> result{};
+Lexer::Lexer(const llvm::MemoryBuffer *buffer)
+    : pos(buffer->getBufferStart()), end(buffer->getBufferEnd()),
+      lineStart(buffer->getBufferStart()) {}
 
-  char *pos = (char *)buffer->getBufferStart();
-  const char *end = buffer->getBufferEnd();
+std::optional<Token> Lexer::next() {
   while (pos < end) {
-    while (std::isspace(*pos))
+    while (std::isspace(*pos)) {
+      if (*pos == '\n') {
+        ++line;
+        lineStart = pos + 1;
+      }
       ++pos;
+    }
 
     // Handle EOF
     if (*pos == '\0')
       break;
 
     TRACE("startpos " << *pos);
+    SourceLocation loc{line, static_cast<unsigned>(pos - lineStart) + 1};
 
     // Handle symbols
     std::optional<Token> symbol_token = Token::from_symbol(*pos);
     if (symbol_token.has_value()) {
-      result.push_back(symbol_token.value());
       TRACE(std::format("adding {}", symbol_token.value()));
       pos++;
-      continue;
+      symbol_token->loc = loc;
+      return symbol_token;
     }
 
     // Handle identifiers
@@ -35,9 +41,10 @@ TokenizeResult tokenize(const llvm::MemoryBuffer *buffer) {
       while (std::isalnum(*pos))
         identifier += *pos++;
 
-      result.push_back(Token(identifier));
       TRACE("adding " << identifier);
-      continue;
+      Token token(identifier);
+      token.loc = loc;
+      return token;
     }
 
     // Handle numbers
@@ -47,9 +54,11 @@ TokenizeResult tokenize(const llvm::MemoryBuffer *buffer) {
         number += *pos++;
       } while (isdigit(*pos) || *pos == '.');
       double value = std::stod(number);
-      result.push_back(Token{TokenKind::Number, OptionalTokenData(value)});
-      TRACE("adding " << value << " pos " << *pos);
-      continue;
+      TRACE("adding number" << log::kv("value", value)
+                            << log::kv("next", *pos));
+      Token token{TokenKind::Number, OptionalTokenData(value)};
+      token.loc = loc;
+      return token;
     }
 
     // Handle comments
@@ -57,14 +66,28 @@ TokenizeResult tokenize(const llvm::MemoryBuffer *buffer) {
       do
         pos++;
       while (*pos != '\0' && *pos != '\n' && *pos != '\r');
-      pos++;
+      // The line break is skipped as whitespace
       continue;
     }
 
-    if (!std::isspace(*pos))
-      return std::format("Could not tokenize '{}'", *pos);
+    if (!std::isspace(*pos)) {
+      this->err = std::format("Could not tokenize '{}'", *pos);
+      pos = end;
+    }
   }
 
+  return std::nullopt;
+}
+
+TokenizeResult tokenize(const llvm::MemoryBuffer *buffer) {
+  std::deque<Token> result{};
+
+  Lexer lexer(buffer);
+  while (auto token = lexer.next())
+    result.push_back(std::move(*token));
+
+  if (lexer.error())
+    return *lexer.error();
   return result;
 }
 
@@ -111,6 +134,10 @@ std::optional<Token> Token::from_symbol(char symbol) {
     return Token(TokenKind::Semicolon);
   case '=':
     return Token(TokenKind::Assignment);
+  case ':':
+    return Token(TokenKind::Colon);
+  case '@':
+    return Token(TokenKind::At);
   default:
     return std::nullopt;
   }
@@ -0,0 +1,83 @@
+#include "logger.hpp"
+#include "llvm/ADT/SmallString.h"
+#include <mutex>
+
+std::atomic<log::LoggingLevel> log::Level = log::error;
+
+namespace {
+
+// Buffered bytes per thread before they are handed to the shared output
+constexpr size_t FlushThreshold = 8192;
+// A single record larger than this (e.g. an AST dump) is passed on in chunks
+// instead of being held in memory whole
+constexpr size_t MaxBuffered = 16 * FlushThreshold;
+
+std::mutex OutputMutex;
+
+class ThreadBuffer final : public llvm::raw_ostream {
+  llvm::SmallString<FlushThreshold> data;
+  uint64_t written = 0;
+
+  void write_impl(const char *ptr, size_t size) override {
+    data.append(ptr, ptr + size);
+    written += size;
+    if (data.size() >= MaxBuffered)
+      flushToOutput();
+  }
+  uint64_t current_pos() const override { return written; }
+
+public:
+  ThreadBuffer() { SetUnbuffered(); }
+  ~ThreadBuffer() override { flushToOutput(); }
+
+  size_t pending() const { return data.size(); }
+
+  void flushToOutput() {
+    if (data.empty())
+      return;
+    std::lock_guard<std::mutex> lock(OutputMutex);
+    llvm::outs() << data;
+    llvm::outs().flush();
+    data.clear();
+  }
+};
+
+ThreadBuffer &threadBuffer() {
+  thread_local ThreadBuffer buffer;
+  return buffer;
+}
+
+const char *levelPrefix(log::LoggingLevel level) {
+  switch (level) {
+  case log::error:
+    return "[Error] ";
+  case log::warn:
+    return "[Warn] ";
+  case log::info:
+    return "[Info] ";
+  case log::debug:
+    return "[Debug] ";
+  case log::trace:
+    return "[Trace] ";
+  }
+  return "";
+}
+
+} // namespace
+
+log::Record::Record(LoggingLevel level, bool prefix) : level(level) {
+  if (prefix)
+    threadBuffer() << levelPrefix(level);
+}
+
+log::Record::~Record() {
+  ThreadBuffer &buffer = threadBuffer();
+  buffer << '\n';
+  // Problems are reported straight away, chatter waits for a full buffer
+  if (level <= log::warn || buffer.pending() >= FlushThreshold)
+    buffer.flushToOutput();
+}
+
+llvm::raw_ostream &log::Record::stream() { return threadBuffer(); }
+
+void log::flush() { threadBuffer().flushToOutput(); }
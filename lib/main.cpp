@@ -1,27 +1,13 @@
-#include "ast/parser.hpp"
 #include "ast/printer.hpp"
-#include "codegen.hpp"
-#include "lexer.hpp"
+#include "driver.hpp"
 #include "logger.hpp"
+#include "target.hpp"
 #include "llvm/Support/CommandLine.h"
-#include "llvm/Support/MemoryBuffer.h"
-#include "llvm/Support/SMLoc.h"
-#include "llvm/Support/SourceMgr.h"
-#include <deque>
-#include <memory>
-#include <print>
-#include <sstream>
-#include <variant>
+#include <string>
+#include <vector>
 
 // CLI parameters
 
-llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional,
-                                         llvm::cl::desc("<input file>"),
-                                         llvm::cl::Required);
-llvm::cl::opt<std::string>
-    OutputFilename("o", llvm::cl::desc("Specify output filename"),
-                   llvm::cl::value_desc("filename"));
-
 llvm::cl::opt<log::LoggingLevel>
     LoggingLevel("log", llvm::cl::desc("Choose the logging level:"),
                  llvm::cl::values(clEnumValN(log::error, "error", "Error"),
@@ -30,49 +16,285 @@ llvm::cl::opt<log::LoggingLevel>
                                   clEnumValN(log::debug, "debug", "Debug"),
                                   clEnumValN(log::trace, "trace", "Trace")));
 
-// Driver functions
-std::unique_ptr<llvm::MemoryBuffer> read_file(std::string filepath) {
-  using FileOrError = llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>;
-  FileOrError result = llvm::MemoryBuffer::getFileOrSTDIN(filepath);
-  return std::move(result.get());
+llvm::cl::list<std::string> InputFilenames(llvm::cl::Positional,
+                                           llvm::cl::desc("<input files>"));
+llvm::cl::opt<std::string>
+    OutputFilename("o",
+                   llvm::cl::desc("Specify output filename (output directory "
+                                  "when compiling several files)"),
+                   llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<bool>
+    Shared("shared",
+           llvm::cl::desc("Write a shared library and a C header declaring its "
+                          "functions instead of an object file"));
+
+llvm::cl::opt<std::string>
+    ManifestFilename("manifest",
+                     llvm::cl::desc("Compile every file listed in <manifest>"),
+                     llvm::cl::value_desc("manifest"));
+llvm::cl::opt<unsigned>
+    Jobs("j", llvm::cl::desc("Number of files to compile, or -run or -eval "
+                             "threads, in parallel (default: one per "
+                             "hardware thread)"),
+         llvm::cl::init(0));
+
+llvm::cl::opt<bool>
+    Repl("repl", llvm::cl::desc("Read definitions and expressions from stdin "
+                                "and run them on a JIT"));
+
+llvm::cl::opt<bool> Pipeline(
+    "pipeline",
+    llvm::cl::desc("Lex, parse and generate code one definition at a time "
+                   "in overlapping stages, freeing each definition's AST once "
+                   "its code is generated (one input only; functions must be "
+                   "defined before use)"));
+
+llvm::cl::opt<bool> WholeProgram(
+    "whole-program",
+    llvm::cl::desc("Link all inputs into one object and optimise across "
+                   "files, assuming nothing outside calls into them"));
+llvm::cl::list<std::string>
+    EntryPoints("entry", llvm::cl::CommaSeparated,
+                llvm::cl::desc("Functions kept callable from outside the "
+                               "program with -whole-program or "
+                               "-prune-unreachable"),
+                llvm::cl::value_desc("name,..."));
+
+llvm::cl::opt<std::string> RunFunction(
+    "run",
+    llvm::cl::desc("Evaluate <function> of the input on every row of the "
+                   "-columns files, writing the results to -o"),
+    llvm::cl::value_desc("function"));
+llvm::cl::list<std::string>
+    Columns("columns", llvm::cl::CommaSeparated,
+            llvm::cl::desc("Argument columns for -run, raw little-endian "
+                           "doubles, one file per argument"),
+            llvm::cl::value_desc("file,..."));
+llvm::cl::opt<uint64_t>
+    Rows("rows",
+         llvm::cl::desc("Number of rows for -run when the function takes no "
+                        "arguments, so there are no -columns to count"),
+         llvm::cl::init(0));
+
+llvm::cl::opt<bool>
+    Evaluate("eval",
+             llvm::cl::desc("Evaluate the input's top-level expressions in "
+                            "parallel on a JIT and print their results"));
+llvm::cl::opt<unsigned> Speculate(
+    "speculate",
+    llvm::cl::desc("With -eval, compile each function on its first call, and "
+                   "the functions it calls speculatively on <threads> "
+                   "threads (default: 0, compile the whole input first)"),
+    llvm::cl::value_desc("threads"), llvm::cl::init(0));
+
+llvm::cl::opt<bool> HashCons(
+    "hash-cons",
+    llvm::cl::desc("Parse repeated pure subexpressions into shared nodes, "
+                   "generating code for each once per scope"));
+
+llvm::cl::opt<unsigned> Specialise(
+    "specialise",
+    llvm::cl::desc("Clone functions for literal arguments passed by at least "
+                   "<calls> call sites (default: 0, never)"),
+    llvm::cl::value_desc("calls"), llvm::cl::init(0));
+
+llvm::cl::opt<bool> PruneUnreachable(
+    "prune-unreachable",
+    llvm::cl::desc("Skip generating code for definitions that no top-level "
+                   "expression or -entry function calls"));
+
+llvm::cl::opt<ast::DumpFormat> DumpAst(
+    "dump-ast", llvm::cl::desc("Print the AST to stdout in the given format:"),
+    llvm::cl::values(
+        clEnumValN(ast::DumpFormat::Tree, "tree", "Indented tree"),
+        clEnumValN(ast::DumpFormat::SExpr, "sexpr",
+                   "One S-expression per function per line"),
+        clEnumValN(ast::DumpFormat::Json, "json",
+                   "One JSON object per function per line")));
+
+enum FPFlag { Reassoc, Contract, NoNaNs, NoInfs, NoSignedZeros, Reciprocal,
+              ApproxFunc };
+
+llvm::cl::opt<bool> FastMath(
+    "ffast-math",
+    llvm::cl::desc("Allow every relaxation of IEEE semantics in -fp-flags"));
+llvm::cl::bits<FPFlag> FPFlags(
+    "fp-flags", llvm::cl::CommaSeparated,
+    llvm::cl::desc("Relax IEEE semantics of generated FP operations:"),
+    llvm::cl::values(
+        clEnumValN(Reassoc, "reassoc", "Allow reassociation"),
+        clEnumValN(Contract, "contract", "Allow contraction into FMAs"),
+        clEnumValN(NoNaNs, "nnan", "Assume no NaNs"),
+        clEnumValN(NoInfs, "ninf", "Assume no infinities"),
+        clEnumValN(NoSignedZeros, "nsz", "Ignore the sign of zeros"),
+        clEnumValN(Reciprocal, "arcp", "Allow reciprocal approximations"),
+        clEnumValN(ApproxFunc, "afn", "Allow approximate functions")));
+
+llvm::cl::opt<std::string>
+    CPU("mcpu",
+        llvm::cl::desc("Target a specific CPU (default: native, the host)"),
+        llvm::cl::value_desc("cpu-name"), llvm::cl::init("native"));
+llvm::cl::list<std::string>
+    Features("mattr", llvm::cl::CommaSeparated,
+             llvm::cl::desc("Target features to enable (+f) or disable (-f)"),
+             llvm::cl::value_desc("a1,+a2,-a3,..."));
+
+llvm::cl::opt<bool> InferTypes(
+    "infer-types", llvm::cl::init(true),
+    llvm::cl::desc("Generate integer and boolean code for values proven to "
+                   "be integers or booleans (default: on)"));
+
+llvm::cl::opt<std::string> OptReport(
+    "opt-report",
+    llvm::cl::desc("Write a JSON report of what each optimisation pass did "
+                   "to each function, and of missed inlining and "
+                   "vectorisation, to <filename>"),
+    llvm::cl::value_desc("filename"));
+
+llvm::cl::opt<bool>
+    DebugInfo("g", llvm::cl::desc("Emit line tables mapping generated code "
+                                  "back to the source, for profilers and "
+                                  "debuggers"));
+llvm::cl::opt<bool> FramePointers(
+    "fno-omit-frame-pointer",
+    llvm::cl::desc("Keep frame pointers, so that profilers can unwind "
+                   "through generated code"));
+llvm::cl::opt<bool> PerfJITDump(
+    "jit-perf", llvm::cl::desc("Write jitdump files describing JIT-compiled "
+                               "code, for `perf inject --jit`"));
+llvm::cl::opt<bool> PerfMap(
+    "perf-map", llvm::cl::desc("Append JIT-compiled functions to "
+                               "/tmp/perf-<pid>.map, for `perf report`"));
+
+llvm::cl::opt<uint64_t> TierUpCalls(
+    "tier-up",
+    llvm::cl::desc("In the REPL, recompile a function at O3 in the "
+                   "background after <calls> calls (default: 0, never)"),
+    llvm::cl::value_desc("calls"), llvm::cl::init(0));
+
+using VectorLibrary = llvm::TargetLibraryInfoImpl::VectorLibrary;
+llvm::cl::opt<VectorLibrary> VecLib(
+    "fveclib",
+    llvm::cl::desc("Vector math library for vectorised libm calls; also "
+                   "turns on loop vectorisation:"),
+    llvm::cl::init(llvm::TargetLibraryInfoImpl::NoLibrary),
+    llvm::cl::values(
+        clEnumValN(llvm::TargetLibraryInfoImpl::NoLibrary, "none",
+                   "Scalar calls only"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::LIBMVEC_X86, "libmvec",
+                   "GLIBC vector math library"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::SVML, "SVML",
+                   "Intel short vector math library"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::SLEEFGNUABI, "SLEEF",
+                   "SLEEF vector math library"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::ArmPL, "ArmPL",
+                   "Arm Performance Libraries"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::AMDLIBM, "AMDLIBM",
+                   "AMD vector math library"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::Accelerate, "Accelerate",
+                   "Apple Accelerate framework"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::DarwinLibSystemM,
+                   "Darwin_libsystem_m", "Darwin libsystem_m"),
+        clEnumValN(llvm::TargetLibraryInfoImpl::MASSV, "MASSV",
+                   "IBM MASS vector library")));
+
+static codegen::Options codegenOptions() {
+  codegen::Options options;
+  options.CPU = CPU;
+  options.Features.assign(Features.begin(), Features.end());
+  options.VecLib = VecLib;
+  options.InferTypes = InferTypes;
+  options.OptReport = !OptReport.empty();
+  options.DebugInfo = DebugInfo;
+  options.FramePointers = FramePointers;
+  options.PerfJITDump = PerfJITDump;
+  options.PerfMap = PerfMap;
+  options.TierUpCalls = TierUpCalls;
+  options.SpeculativeThreads = Speculate;
+  llvm::FastMathFlags &fmf = options.FastMath;
+  if (FastMath)
+    fmf.setFast();
+  if (FPFlags.isSet(Reassoc))
+    fmf.setAllowReassoc();
+  if (FPFlags.isSet(Contract))
+    fmf.setAllowContract();
+  if (FPFlags.isSet(NoNaNs))
+    fmf.setNoNaNs();
+  if (FPFlags.isSet(NoInfs))
+    fmf.setNoInfs();
+  if (FPFlags.isSet(NoSignedZeros))
+    fmf.setNoSignedZeros();
+  if (FPFlags.isSet(Reciprocal))
+    fmf.setAllowReciprocal();
+  if (FPFlags.isSet(ApproxFunc))
+    fmf.setApproxFunc();
+  return options;
 }
 
-int compile(const llvm::MemoryBuffer *buf, std::string filename) {
-  // Lexer
-  DEBUG("*** Source ***\n" << buf->getBuffer().str());
-  auto lexer_result = tokenize(buf);
-  if (std::holds_alternative<std::string>(lexer_result)) {
-    ERROR("Lexer error: " << std::get<std::string>(lexer_result));
+int main(int argc, char *argv[]) {
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+  log::setLevel(LoggingLevel);
+
+  if (Repl) {
+    target::initialise();
+    return driver::repl(codegenOptions());
+  }
+
+  std::vector<std::string> inputs(InputFilenames.begin(),
+                                  InputFilenames.end());
+  if (!ManifestFilename.empty()) {
+    auto listed = driver::readManifest(ManifestFilename);
+    inputs.insert(inputs.end(), listed.begin(), listed.end());
+  }
+
+  if (inputs.empty()) {
+    ERROR("No input files");
     return 1;
   }
-  auto tokens = std::get<std::deque<Token>>(lexer_result);
-  DEBUG("*** Tokens ***");
 
-  if (LoggingLevel >= log::debug) {
-    std::stringstream tokensLog;
-    for (Token &token : tokens) {
-      tokensLog << std::format("{} ", token);
+  target::initialise();
+
+  if (!RunFunction.empty()) {
+    if (inputs.size() != 1 || OutputFilename.empty()) {
+      ERROR("-run needs exactly one input file and an output column (-o)");
+      return 1;
     }
-    DEBUG(tokensLog.str());
+    return driver::run(inputs.front(), RunFunction,
+                       {Columns.begin(), Columns.end()}, OutputFilename, Rows,
+                       Jobs, codegenOptions());
   }
 
-  // Parser
-  auto ast = parser::parse(tokens, filename);
-  DEBUG("*** AST ***");
-  DEBUG(std::format("{}", *ast));
-
-  // Codegen
-  codegen::codegen(ast.get());
+  if (Evaluate) {
+    if (inputs.size() != 1) {
+      ERROR("-eval needs exactly one input file");
+      return 1;
+    }
+    return driver::evaluate(inputs.front(), Jobs, codegenOptions());
+  }
+  if (Speculate)
+    WARN("-speculate is ignored without -eval");
 
-  return 0;
-}
+  if (WholeProgram)
+    return driver::compileWholeProgram(
+        inputs, {EntryPoints.begin(), EntryPoints.end()}, codegenOptions(),
+        OutputFilename.empty() ? "a.o" : OutputFilename);
 
-int main(int argc, char *argv[]) {
-  llvm::cl::ParseCommandLineOptions(argc, argv);
+  if (Pipeline) {
+    if (inputs.size() != 1 || !ManifestFilename.empty()) {
+      ERROR("-pipeline needs exactly one input file");
+      return 1;
+    }
+    return driver::compilePipelined(inputs.front(), codegenOptions(),
+                                    OutputFilename);
+  }
+  if (inputs.size() == 1 && ManifestFilename.empty())
+    return driver::compileFile(inputs.front(), codegenOptions(),
+                               OutputFilename);
 
-  auto buffer = read_file(InputFilename);
-  llvm::SourceMgr source_manager;
-  auto id = source_manager.AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
-  const llvm::MemoryBuffer *buf = source_manager.getMemoryBuffer(id);
-  return compile(buf, InputFilename);
+  driver::BatchOptions options;
+  options.codegen = codegenOptions();
+  options.jobs = Jobs;
+  options.outputDir = OutputFilename;
+  return driver::compileBatch(inputs, options);
 }
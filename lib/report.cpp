@@ -0,0 +1,179 @@
+#include "report.hpp"
+#include "llvm/ADT/Any.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LazyCallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/JSON.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Snapshot = std::map<std::string, report::OptReport::Counts>;
+
+// Pass managers and adaptors only run other passes
+bool isContainer(llvm::StringRef pass) {
+  return llvm::isSpecialPass(pass, {"PassManager", "PassAdaptor",
+                                    "RepeatedPass", "WrapperPass"});
+}
+
+report::OptReport::Counts count(const llvm::Function &f) {
+  report::OptReport::Counts counts;
+  for (const llvm::BasicBlock &bb : f) {
+    ++counts.blocks;
+    for (const llvm::Instruction &inst : bb) {
+      ++counts.instructions;
+      if (llvm::isa<llvm::CallBase>(inst))
+        ++counts.calls;
+    }
+  }
+  return counts;
+}
+
+// Counts for every function defined in the unit of IR a pass runs on
+Snapshot snapshot(llvm::Any ir) {
+  Snapshot counts;
+  auto add = [&](const llvm::Function &f) {
+    if (!f.isDeclaration())
+      counts[f.getName().str()] = count(f);
+  };
+
+  if (auto *f = llvm::any_cast<const llvm::Function *>(&ir)) {
+    add(**f);
+  } else if (auto *loop = llvm::any_cast<const llvm::Loop *>(&ir)) {
+    add(*(*loop)->getHeader()->getParent());
+  } else if (auto *scc =
+                 llvm::any_cast<const llvm::LazyCallGraph::SCC *>(&ir)) {
+    for (const llvm::LazyCallGraph::Node &node : **scc)
+      add(node.getFunction());
+  } else if (auto *module = llvm::any_cast<const llvm::Module *>(&ir)) {
+    for (const llvm::Function &f : **module)
+      add(f);
+  }
+  return counts;
+}
+
+// Keeps the missed-optimisation remarks of the passes we report on and
+// leaves every other diagnostic to the default handling
+class RemarkCollector : public llvm::DiagnosticHandler {
+  report::OptReport &report;
+
+public:
+  RemarkCollector(report::OptReport &report) : report(report) {}
+
+  // Passes only build a remark when some remark is enabled; without this
+  // only the -pass-remarks options would count
+  bool isAnyRemarkEnabled() const override { return true; }
+
+  bool isMissedOptRemarkEnabled(llvm::StringRef pass) const override {
+    return pass == "inline" || pass == "loop-vectorize" ||
+           pass == "slp-vectorizer";
+  }
+
+  bool handleDiagnostics(const llvm::DiagnosticInfo &di) override {
+    auto *remark = llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&di);
+    if (!remark || !remark->isMissed() ||
+        !isMissedOptRemarkEnabled(remark->getPassName()))
+      return false;
+    report.addRemark(remark->getFunction().getName().str(),
+                     {remark->getPassName().str(),
+                      remark->getRemarkName().str(), remark->getMsg()});
+    return true;
+  }
+};
+
+void writeCounts(llvm::json::OStream &json, llvm::StringRef key,
+                 const report::OptReport::Counts &counts) {
+  json.attributeObject(key, [&] {
+    json.attribute("instructions", static_cast<int64_t>(counts.instructions));
+    json.attribute("blocks", static_cast<int64_t>(counts.blocks));
+    json.attribute("calls", static_cast<int64_t>(counts.calls));
+  });
+}
+
+} // namespace
+
+void report::OptReport::attach(llvm::LLVMContext &context) {
+  registerCallbacks();
+  context.setDiagnosticHandler(std::make_unique<RemarkCollector>(*this));
+}
+
+void report::OptReport::registerCallbacks() {
+  if (registered)
+    return;
+  registered = true;
+
+  callbacks.registerBeforeNonSkippedPassCallback(
+      [this](llvm::StringRef pass, llvm::Any ir) {
+        if (isContainer(pass))
+          return;
+        running.push_back({snapshot(ir), Clock::now()});
+      });
+  callbacks.registerAfterPassCallback(
+      [this](llvm::StringRef pass, llvm::Any ir,
+             const llvm::PreservedAnalyses &) {
+        if (isContainer(pass))
+          return;
+        finish(pass, snapshot(ir));
+      });
+  // The unit is gone, e.g. a deleted loop; there is nothing to count
+  callbacks.registerAfterPassInvalidatedCallback(
+      [this](llvm::StringRef pass, const llvm::PreservedAnalyses &) {
+        if (!isContainer(pass))
+          running.pop_back();
+      });
+}
+
+void report::OptReport::finish(llvm::StringRef pass, Snapshot after) {
+  Running run = std::move(running.back());
+  running.pop_back();
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - run.start).count();
+
+  // Functions the pass created appear with nothing before; deleted ones with
+  // nothing after
+  for (auto &[name, counts] : after)
+    run.before.try_emplace(name);
+  for (auto &[name, before] : run.before) {
+    auto found = after.find(name);
+    functions[name].passes.push_back(
+        {pass.str(), before, found == after.end() ? Counts{} : found->second,
+         seconds});
+  }
+}
+
+void report::OptReport::write(llvm::raw_ostream &os) const {
+  llvm::json::OStream json(os, 2);
+  json.object([&] {
+    json.attributeArray("functions", [&] {
+      for (auto &[name, function] : functions) {
+        json.object([&] {
+          json.attribute("name", name);
+          json.attributeArray("passes", [&] {
+            for (auto &run : function.passes)
+              json.object([&] {
+                json.attribute("pass", run.pass);
+                writeCounts(json, "before", run.before);
+                writeCounts(json, "after", run.after);
+                json.attribute("seconds", run.seconds);
+              });
+          });
+          json.attributeArray("remarks", [&] {
+            for (auto &remark : function.remarks)
+              json.object([&] {
+                json.attribute("pass", remark.pass);
+                json.attribute("name", remark.name);
+                json.attribute("message", remark.message);
+              });
+          });
+        });
+      }
+    });
+  });
+  os << '\n';
+}
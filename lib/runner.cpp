@@ -0,0 +1,191 @@
+#include "runner.hpp"
+#include "logger.hpp"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/SwapByteOrder.h"
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <optional>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+namespace fs = llvm::sys::fs;
+
+// Working set of one chunk, all columns included; about an L2 cache
+constexpr size_t ChunkBytes = 256 * 1024;
+constexpr uint64_t MinChunkRows = 1024;
+
+// A column file mapped into memory. Empty columns have no mapping.
+struct Column {
+  std::optional<fs::mapped_file_region> region;
+  uint64_t rows = 0;
+
+  double *data() const {
+    return region ? reinterpret_cast<double *>(region->data()) : nullptr;
+  }
+};
+
+std::optional<Column> mapInput(const std::string &path) {
+  uint64_t size;
+  if (std::error_code ec = fs::file_size(path, size)) {
+    ERROR("Could not read " << path << ": " << ec.message());
+    return std::nullopt;
+  }
+  if (size % sizeof(double) != 0) {
+    ERROR(path << " is not a column of doubles: " << size << " bytes");
+    return std::nullopt;
+  }
+
+  Column column;
+  column.rows = size / sizeof(double);
+  if (size == 0)
+    return column;
+
+  auto fd = fs::openNativeFileForRead(path);
+  if (!fd) {
+    ERROR("Could not open " << path << ": "
+                            << llvm::toString(fd.takeError()));
+    return std::nullopt;
+  }
+  std::error_code ec;
+  column.region.emplace(*fd, fs::mapped_file_region::readonly, size, 0, ec);
+  fs::closeFile(*fd);
+  if (ec) {
+    ERROR("Could not map " << path << ": " << ec.message());
+    return std::nullopt;
+  }
+  return column;
+}
+
+std::optional<Column> mapOutput(const std::string &path, uint64_t rows) {
+  auto fd = fs::openNativeFileForReadWrite(path, fs::CD_CreateAlways,
+                                           fs::OF_None);
+  if (!fd) {
+    ERROR("Could not open " << path << ": "
+                            << llvm::toString(fd.takeError()));
+    return std::nullopt;
+  }
+
+  Column column;
+  column.rows = rows;
+  uint64_t size = rows * sizeof(double);
+  std::error_code ec = fs::resize_file(*fd, size);
+  if (!ec && size > 0)
+    column.region.emplace(*fd, fs::mapped_file_region::readwrite, size, 0,
+                          ec);
+  fs::closeFile(*fd);
+  if (ec) {
+    ERROR("Could not map " << path << ": " << ec.message());
+    return std::nullopt;
+  }
+  return column;
+}
+
+// Run the calling thread on the `index`th CPU it is allowed on, so its
+// memory is allocated on that CPU's node and stays there
+void pinCurrentThread(unsigned index) {
+#if defined(__linux__)
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+  int count = CPU_COUNT(&allowed);
+  if (count == 0)
+    return;
+
+  int wanted = index % count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed) || wanted-- > 0)
+      continue;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    return;
+  }
+#else
+  (void)index;
+#endif
+}
+
+} // namespace
+
+bool runner::evaluate(codegen::BatchEntry *entry,
+                      const std::vector<std::string> &inputs,
+                      const std::string &outputPath, uint64_t rows,
+                      unsigned jobs) {
+  using Clock = std::chrono::steady_clock;
+
+  if (!llvm::sys::IsLittleEndianHost) {
+    ERROR("Column files hold little-endian doubles; this host is big-endian");
+    return false;
+  }
+
+  // The output is truncated before anything is read, so it must not be one
+  // of the inputs
+  for (auto &path : inputs) {
+    bool same = false;
+    if (!fs::equivalent(path, outputPath, same) && same) {
+      ERROR("Output " << outputPath << " is also the input column " << path);
+      return false;
+    }
+  }
+
+  std::vector<Column> columns;
+  for (auto &path : inputs) {
+    auto column = mapInput(path);
+    if (!column)
+      return false;
+    if (!columns.empty() && column->rows != columns.front().rows) {
+      ERROR(path << " has " << column->rows << " rows, " << inputs.front()
+                 << " has " << columns.front().rows);
+      return false;
+    }
+    columns.push_back(std::move(*column));
+  }
+
+  // A function without arguments has no column to take the row count from
+  if (!columns.empty())
+    rows = columns.front().rows;
+
+  auto output = mapOutput(outputPath, rows);
+  if (!output)
+    return false;
+
+  if (jobs == 0)
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  const uint64_t chunkRows = std::max<uint64_t>(
+      MinChunkRows, ChunkBytes / (sizeof(double) * (columns.size() + 1)));
+  // Whole chunks per thread, so no two threads share an output page
+  const uint64_t chunks = (rows + chunkRows - 1) / chunkRows;
+  const uint64_t threadRows = (chunks + jobs - 1) / jobs * chunkRows;
+
+  auto start = Clock::now();
+  {
+    std::vector<std::jthread> threads;
+    for (unsigned t = 0; t < jobs && t * threadRows < rows; ++t) {
+      threads.emplace_back([&, t] {
+        pinCurrentThread(t);
+        uint64_t end = std::min(rows, (t + 1) * threadRows);
+        std::vector<const double *> args(columns.size());
+        for (uint64_t row = t * threadRows; row < end; row += chunkRows) {
+          for (size_t i = 0; i < columns.size(); ++i)
+            args[i] = columns[i].data() + row;
+          entry(args.data(), output->data() + row,
+                std::min(chunkRows, end - row));
+        }
+      });
+    }
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  INFO(std::format("Evaluated {} rows in {:.3f}s ({:.3g} rows/s)", rows,
+                   seconds, seconds > 0 ? rows / seconds : 0.0));
+  return true;
+}
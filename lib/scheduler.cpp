@@ -0,0 +1,125 @@
+#include "scheduler.hpp"
+#include <algorithm>
+
+namespace {
+
+// Worker index of the calling thread within CurrentPool, if any
+thread_local const scheduler::WorkStealingPool *CurrentPool = nullptr;
+thread_local unsigned CurrentWorker = 0;
+
+} // namespace
+
+scheduler::WorkStealingPool::WorkStealingPool(unsigned threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned i = 0; i < threads; ++i)
+    workers.push_back(std::make_unique<Worker>());
+  for (unsigned i = 0; i < threads; ++i)
+    this->threads.emplace_back([this, i] { run(i); });
+}
+
+scheduler::WorkStealingPool::~WorkStealingPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(stateMutex);
+    stopping = true;
+  }
+  workAvailable.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+}
+
+void scheduler::WorkStealingPool::submit(Task task) {
+  unsigned target = CurrentPool == this
+                        ? CurrentWorker
+                        : nextWorker.fetch_add(1) % workers.size();
+
+  unfinished.fetch_add(1);
+  {
+    // Count the task before it becomes visible so `queued` never underflows,
+    // and under the lock so a worker cannot miss it on its way to sleep
+    std::lock_guard<std::mutex> lock(stateMutex);
+    queued.fetch_add(1);
+  }
+  {
+    std::lock_guard<std::mutex> lock(workers[target]->mutex);
+    workers[target]->tasks.push_back(std::move(task));
+  }
+  workAvailable.notify_one();
+}
+
+void scheduler::WorkStealingPool::wait() {
+  std::unique_lock<std::mutex> lock(stateMutex);
+  allDone.wait(lock, [this] { return unfinished.load() == 0; });
+}
+
+bool scheduler::WorkStealingPool::popLocal(unsigned self, Task &task) {
+  Worker &worker = *workers[self];
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  if (worker.tasks.empty())
+    return false;
+  task = std::move(worker.tasks.back());
+  worker.tasks.pop_back();
+  queued.fetch_sub(1);
+  return true;
+}
+
+// Busy deques are skipped at first and only waited for if no other deque had
+// a task, so a failed steal means every deque was seen empty
+bool scheduler::WorkStealingPool::steal(unsigned self, Task &task) {
+  bool contended = false;
+  for (bool blocking : {false, true}) {
+    if (blocking && !contended)
+      break;
+    for (unsigned offset = 1; offset < workers.size(); ++offset) {
+      Worker &victim = *workers[(self + offset) % workers.size()];
+      std::unique_lock<std::mutex> lock(victim.mutex, std::defer_lock);
+      if (blocking) {
+        lock.lock();
+      } else if (!lock.try_lock()) {
+        contended = true;
+        continue;
+      }
+      if (victim.tasks.empty())
+        continue;
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void scheduler::WorkStealingPool::run(unsigned self) {
+  CurrentPool = this;
+  CurrentWorker = self;
+
+  while (true) {
+    Task task;
+    if (popLocal(self, task) || steal(self, task)) {
+      task();
+      task = nullptr;
+
+      if (unfinished.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        allDone.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(stateMutex);
+    // Every deque was seen empty, so a task still counted in `queued` is
+    // being pushed right now; let its submitter run instead of rescanning
+    if (queued.load() > 0) {
+      lock.unlock();
+      std::this_thread::yield();
+      continue;
+    }
+    workAvailable.wait(lock,
+                       [this] { return stopping || queued.load() > 0; });
+    if (stopping && queued.load() == 0)
+      return;
+  }
+}
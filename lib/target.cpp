@@ -0,0 +1,120 @@
+#include "target.hpp"
+#include "logger.hpp"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/TargetParser/SubtargetFeature.h"
+#include <mutex>
+
+void target::initialise() {
+  static std::once_flag initialised;
+  std::call_once(initialised, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
+}
+
+std::unique_ptr<llvm::TargetMachine>
+target::createTargetMachine(const codegen::Options &options) {
+  std::string triple = llvm::sys::getDefaultTargetTriple();
+
+  std::string error;
+  const llvm::Target *target =
+      llvm::TargetRegistry::lookupTarget(triple, error);
+  if (!target) {
+    ERROR("Could not find target " << triple << ": " << error);
+    return nullptr;
+  }
+
+  const llvm::FastMathFlags &fmf = options.FastMath;
+  llvm::TargetOptions targetOptions;
+  // Contractable fmul/fadd pairs may be fused into FMAs
+  targetOptions.AllowFPOpFusion =
+      fmf.allowContract() ? llvm::FPOpFusion::Fast : llvm::FPOpFusion::Standard;
+  targetOptions.UnsafeFPMath = fmf.isFast();
+  targetOptions.NoNaNsFPMath = fmf.noNaNs();
+  targetOptions.NoInfsFPMath = fmf.noInfs();
+  targetOptions.NoSignedZerosFPMath = fmf.noSignedZeros();
+  targetOptions.ApproxFuncFPMath = fmf.approxFunc();
+
+  std::string cpu = options.CPU;
+  llvm::SubtargetFeatures features;
+  if (cpu == "native") {
+    cpu = llvm::sys::getHostCPUName().str();
+    llvm::StringMap<bool> hostFeatures;
+    if (llvm::sys::getHostCPUFeatures(hostFeatures))
+      for (auto &feature : hostFeatures)
+        features.AddFeature(feature.first(), feature.second);
+  }
+  // Explicit features are added last so they override detected ones
+  for (auto &feature : options.Features)
+    features.AddFeature(feature);
+
+  DEBUG("Target" << log::kv("triple", triple) << log::kv("cpu", cpu)
+                 << log::kv("features", features.getString()));
+
+  return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+      triple, cpu, features.getString(), targetOptions, llvm::Reloc::PIC_));
+}
+
+void target::configureModule(llvm::Module &module,
+                             const llvm::TargetMachine &tm) {
+  module.setTargetTriple(tm.getTargetTriple().str());
+  module.setDataLayout(tm.createDataLayout());
+}
+
+bool target::emitObject(llvm::Module &module, llvm::TargetMachine &tm,
+                        const std::string &path) {
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+  if (ec) {
+    ERROR("Could not open " << path << ": " << ec.message());
+    return false;
+  }
+
+  llvm::legacy::PassManager pm;
+  if (tm.addPassesToEmitFile(pm, out, nullptr,
+                             llvm::CodeGenFileType::ObjectFile)) {
+    ERROR("Target cannot emit object files");
+    return false;
+  }
+
+  pm.run(module);
+  out.flush();
+  return true;
+}
+
+bool target::emitSharedLibrary(llvm::Module &module, llvm::TargetMachine &tm,
+                               const std::string &path) {
+  llvm::SmallString<128> object;
+  if (auto ec =
+          llvm::sys::fs::createTemporaryFile("kaleidoscope", "o", object)) {
+    ERROR("Could not create a temporary object file: " << ec.message());
+    return false;
+  }
+  llvm::FileRemover removeObject(object);
+  if (!emitObject(module, tm, std::string(object)))
+    return false;
+
+  auto cc = llvm::sys::findProgramByName("cc");
+  if (!cc) {
+    ERROR("Could not find cc to link " << path);
+    return false;
+  }
+
+  std::string error;
+  llvm::StringRef args[] = {*cc, "-shared", "-o", path, object, "-lm"};
+  if (llvm::sys::ExecuteAndWait(*cc, args, std::nullopt, {}, 0, 0, &error)) {
+    ERROR("Could not link " << path << (error.empty() ? "" : ": ") << error);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,48 @@
+/* Compiling and calling Kaleidoscope from C through kaleidoscope.h:
+ *
+ *   clang samples/engine.c -Iinclude -Lbuild -lkaleidoscope -o engine
+ *   LD_LIBRARY_PATH=build ./engine
+ *
+ * Given any argument (`./engine lazy`), the engine compiles each function on
+ * its first call and speculatively compiles what it calls on two background
+ * threads.
+ */
+#include "kaleidoscope.h"
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+  (void)argv;
+  kaleidoscope_engine *engine = argc > 1
+                                    ? kaleidoscope_engine_create_speculative(2)
+                                    : kaleidoscope_engine_create();
+  if (!engine)
+    return 1;
+
+  const char *source = "def square(x) x * x\n"
+                       "def hypot2(a, b) square(a) + square(b)\n"
+                       "def mix(a, b, t) a + (b - a) * t\n";
+  kaleidoscope_module module =
+      kaleidoscope_compile(engine, source, strlen(source));
+  if (!module) {
+    kaleidoscope_engine_destroy(engine);
+    return 1;
+  }
+
+  double (*hypot2)(double, double) =
+      (double (*)(double, double))kaleidoscope_lookup(engine, "hypot2");
+  double (*mix)(double, double, double) =
+      (double (*)(double, double, double))kaleidoscope_lookup(engine, "mix");
+  if (hypot2 && mix)
+    printf("hypot2(3, 4) = %g\nmix(0, 10, 0.25) = %g\n", hypot2(3, 4),
+           mix(0, 10, 0.25));
+
+  /* The same source as a library for programs that link it directly */
+  if (kaleidoscope_emit_shared_library(engine, source, strlen(source),
+                                       "libmix.so", "mix.h") != 0)
+    fprintf(stderr, "could not write libmix.so\n");
+
+  kaleidoscope_release(engine, module);
+  kaleidoscope_engine_destroy(engine);
+  return 0;
+}